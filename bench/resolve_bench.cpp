@@ -0,0 +1,366 @@
+// resolve_bench.cpp
+//
+// Micro-benchmark for liboverridehosts.so. Builds a table of N generated
+// names, re-executes itself with the library preloaded and times
+// getaddrinfo() / gethostbyname() per call from T threads.
+//
+//   hit   a random generated name, answered from the table
+//   repeat  the same three table names over and over, like a worker
+//         talking to a few backends
+//   miss  a numeric literal that is not in the table, so the call pays the
+//         table probe and then libc's numeric fast path (no DNS traffic)
+//
+// Output is one JSON object per (api, kind, entries, threads) on stdout:
+//   {"api":"getaddrinfo","kind":"hit","preload":true,"entries":1000,
+//    "threads":4,"calls":200000,"failures":0,"ops_per_sec":...,
+//    "p50_ns":...,"p90_ns":...,"p99_ns":...,"p999_ns":...,"max_ns":...,
+//    "allocs_per_call":...}
+// allocs_per_call counts malloc/calloc/realloc made while timing, shim
+// and libc included (glibc only; -1 elsewhere).
+//
+// Usage:
+//   resolve_bench [--lib ./liboverridehosts-glibc.so] [--entries N] [--threads T]
+//                 [--iters N] [--name-len L] [--api getaddrinfo|gethostbyname|all]
+//                 [--kind hit|repeat|miss|all] [--sweep] [--no-preload]
+//   --sweep runs entries 10..1M x threads 1..128, one child per table size.
+//   --no-preload times the same calls against plain libc as a baseline.
+//   --name-len pads generated names to L bytes (typical FQDNs are 20-60).
+//
+// Build:
+//   g++ -O2 -std=c++17 -o resolve_bench bench/resolve_bench.cpp -lpthread
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../overridehosts_table.h"
+
+static const char* kChildEnv = "RESOLVE_BENCH_CHILD";
+
+static void die(const std::string& msg) {
+  std::cerr << "resolve_bench: " << msg << "\n";
+  std::exit(1);
+}
+
+// --- allocation counting ---
+// The executable's malloc wins symbol lookup over libc's, so this sees the
+// shim's allocations as well as the application's.
+static std::atomic<bool> g_counting{false};
+static std::atomic<uint64_t> g_allocs{0};
+
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+
+static inline void count_alloc() {
+  if (g_counting.load(std::memory_order_relaxed)) g_allocs.fetch_add(1, std::memory_order_relaxed);
+}
+
+extern "C" void* malloc(size_t n) { count_alloc(); return __libc_malloc(n); }
+extern "C" void* calloc(size_t n, size_t m) { count_alloc(); return __libc_calloc(n, m); }
+extern "C" void* realloc(void* p, size_t n) { count_alloc(); return __libc_realloc(p, n); }
+static const bool kCountsAllocs = true;
+#else
+static const bool kCountsAllocs = false;
+#endif
+
+// --- options ---
+struct Options {
+  std::string lib = "./liboverridehosts-glibc.so";
+  uint32_t entries = 1000;
+  uint32_t name_len = 0;  // 0: the short default names
+  unsigned threads = 1;
+  uint64_t iters = 200000;  // per (api, kind), split across threads
+  bool gai = true, ghbn = true;
+  bool hit = true, repeat = true, miss = true;
+  bool sweep = false;
+  bool preload = true;
+};
+
+static uint64_t parse_num(const char* s, const char* what) {
+  char* end;
+  errno = 0;
+  unsigned long long v = std::strtoull(s, &end, 10);
+  if (errno || *end || v == 0) die(std::string("bad ") + what + ": " + s);
+  return v;
+}
+
+static Options parse_args(int argc, char** argv) {
+  Options o;
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    auto val = [&]() -> const char* {
+      if (i + 1 >= argc) die("missing value for " + a);
+      return argv[++i];
+    };
+    if (a == "--lib") o.lib = val();
+    else if (a == "--entries") o.entries = (uint32_t)parse_num(val(), "--entries");
+    else if (a == "--name-len") o.name_len = (uint32_t)parse_num(val(), "--name-len");
+    else if (a == "--threads") o.threads = (unsigned)parse_num(val(), "--threads");
+    else if (a == "--iters") o.iters = parse_num(val(), "--iters");
+    else if (a == "--sweep") o.sweep = true;
+    else if (a == "--no-preload") o.preload = false;
+    else if (a == "--api") {
+      std::string v = val();
+      if (v != "all" && v != "getaddrinfo" && v != "gethostbyname") die("bad --api: " + v);
+      o.gai = v != "gethostbyname";
+      o.ghbn = v != "getaddrinfo";
+    } else if (a == "--kind") {
+      std::string v = val();
+      if (v != "all" && v != "hit" && v != "repeat" && v != "miss") die("bad --kind: " + v);
+      o.hit = v == "all" || v == "hit";
+      o.repeat = v == "all" || v == "repeat";
+      o.miss = v == "all" || v == "miss";
+    } else {
+      die("unknown option " + a);
+    }
+  }
+  return o;
+}
+
+// --- workload ---
+// "h<i>.bench.test", padded with "svc-..." labels to at least name_len bytes.
+static std::string host_name(uint32_t i, uint32_t name_len) {
+  std::string head = "h" + std::to_string(i) + ".";
+  const std::string tail = "bench.test";
+  while (head.size() + tail.size() < name_len) {
+    size_t label = std::min<size_t>(name_len - head.size() - tail.size(), 12);
+    head += "svc-" + std::string(label > 5 ? label - 5 : 1, 'a' + (char)(head.size() % 26)) + ".";
+  }
+  return head + tail;
+}
+
+static std::string host_addr(uint32_t i) {
+  return "10." + std::to_string((i >> 16) & 255) + "." + std::to_string((i >> 8) & 255) + "." +
+         std::to_string(i & 255);
+}
+
+static std::string write_table(uint32_t entries, uint32_t name_len) {
+  overridehosts::TableBuilder b;
+  for (uint32_t i = 0; i < entries; i++) b.add(host_name(i, name_len), host_addr(i));
+  std::vector<char> image = b.finish();
+
+  char path[] = "/tmp/resolve_bench.XXXXXX";
+  int fd = ::mkstemp(path);
+  if (fd < 0) die(std::string("mkstemp: ") + std::strerror(errno));
+  size_t off = 0;
+  while (off < image.size()) {
+    ssize_t n = ::write(fd, image.data() + off, image.size() - off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) die(std::string("write: ") + std::strerror(errno));
+    off += (size_t)n;
+  }
+  ::close(fd);
+  return path;
+}
+
+static uint32_t xorshift(uint32_t& s) {
+  s ^= s << 13;
+  s ^= s >> 17;
+  s ^= s << 5;
+  return s;
+}
+
+enum class Api { Getaddrinfo, Gethostbyname };
+enum class Kind { Hit, Repeat, Miss };
+
+static bool resolve_one(Api api, const char* name) {
+  if (api == Api::Getaddrinfo) {
+    addrinfo hints{};
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    if (getaddrinfo(name, nullptr, &hints, &res) != 0) return false;
+    freeaddrinfo(res);
+    return true;
+  }
+  return gethostbyname(name) != nullptr;
+}
+
+struct Result {
+  uint64_t calls = 0;
+  uint64_t failures = 0;
+  double seconds = 0;
+  std::vector<uint32_t> ns;
+  uint64_t allocs = 0;
+};
+
+static Result run(Api api, const Options& o, const std::vector<std::string>& names,
+                  unsigned threads) {
+  uint64_t per_thread = std::max<uint64_t>(o.iters / threads, 1000);
+  std::vector<std::vector<uint32_t>> samples(threads);
+  std::vector<uint64_t> failures(threads);
+  for (auto& s : samples) s.reserve(per_thread);
+
+  // Warm up table pages, the result pool and per-thread caches.
+  for (size_t i = 0; i < std::min<size_t>(names.size(), 1000); i++) resolve_one(api, names[i].c_str());
+
+  std::atomic<unsigned> ready{0};
+  std::atomic<bool> go{false};
+  auto body = [&](unsigned t) {
+    uint32_t seed = 0x9e3779b9u * (t + 1);
+    std::vector<uint32_t>& out = samples[t];
+    uint64_t fail = 0;
+    ready.fetch_add(1);
+    while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+    for (uint64_t i = 0; i < per_thread; i++) {
+      const std::string& n = names[xorshift(seed) % names.size()];
+      auto t0 = std::chrono::steady_clock::now();
+      bool ok = resolve_one(api, n.c_str());
+      auto t1 = std::chrono::steady_clock::now();
+      out.push_back((uint32_t)std::min<int64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count(), UINT32_MAX));
+      fail += !ok;
+    }
+    failures[t] = fail;
+  };
+
+  std::vector<std::thread> ts;
+  for (unsigned t = 0; t < threads; t++) ts.emplace_back(body, t);
+  while (ready.load() != threads) std::this_thread::yield();
+
+  g_allocs.store(0);
+  g_counting.store(true);
+  auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& t : ts) t.join();
+  auto end = std::chrono::steady_clock::now();
+  g_counting.store(false);
+
+  Result r;
+  r.allocs = g_allocs.load();
+  r.seconds = std::chrono::duration<double>(end - start).count();
+  for (unsigned t = 0; t < threads; t++) {
+    r.ns.insert(r.ns.end(), samples[t].begin(), samples[t].end());
+    r.failures += failures[t];
+  }
+  r.calls = r.ns.size();
+  return r;
+}
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t i = (size_t)(p * (double)(sorted.size() - 1) + 0.5);
+  return sorted[std::min(i, sorted.size() - 1)];
+}
+
+static void report(Api api, Kind kind, uint32_t entries, unsigned threads, bool preload, Result& r) {
+  std::sort(r.ns.begin(), r.ns.end());
+  double allocs = kCountsAllocs ? (double)r.allocs / (double)r.calls : -1;
+  std::printf("{\"api\":\"%s\",\"kind\":\"%s\",\"preload\":%s,\"entries\":%u,\"threads\":%u,"
+              "\"calls\":%llu,\"failures\":%llu,\"ops_per_sec\":%.0f,"
+              "\"p50_ns\":%u,\"p90_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,\"max_ns\":%u,"
+              "\"allocs_per_call\":%.3f}\n",
+              api == Api::Getaddrinfo ? "getaddrinfo" : "gethostbyname",
+              kind == Kind::Hit ? "hit" : kind == Kind::Repeat ? "repeat" : "miss", preload ? "true" : "false", entries, threads,
+              (unsigned long long)r.calls, (unsigned long long)r.failures, (double)r.calls / r.seconds,
+              percentile(r.ns, 0.50), percentile(r.ns, 0.90), percentile(r.ns, 0.99),
+              percentile(r.ns, 0.999), r.ns.empty() ? 0 : r.ns.back(), allocs);
+  std::fflush(stdout);
+}
+
+// Runs inside the preloaded child (or directly with --no-preload).
+static int bench(const Options& o, const std::vector<unsigned>& thread_counts) {
+  std::vector<std::string> hits, misses;
+  uint32_t distinct = std::min<uint32_t>(o.entries, 1u << 16);
+  for (uint32_t i = 0; i < distinct; i++) {
+    hits.push_back(host_name((uint32_t)(((uint64_t)i * 2654435761u) % o.entries), o.name_len));
+    misses.push_back("192.0.2." + std::to_string(i & 255));
+  }
+  std::vector<std::string> repeats(hits.begin(), hits.begin() + std::min<size_t>(hits.size(), 3));
+
+  for (unsigned threads : thread_counts) {
+    for (Api api : {Api::Getaddrinfo, Api::Gethostbyname}) {
+      if (!(api == Api::Getaddrinfo ? o.gai : o.ghbn)) continue;
+      // Hits need the table; the baseline only measures misses.
+      if (o.hit && o.preload) {
+        Result r = run(api, o, hits, threads);
+        report(api, Kind::Hit, o.entries, threads, o.preload, r);
+      }
+      if (o.repeat && o.preload) {
+        Result r = run(api, o, repeats, threads);
+        report(api, Kind::Repeat, o.entries, threads, o.preload, r);
+      }
+      if (o.miss) {
+        Result r = run(api, o, misses, threads);
+        report(api, Kind::Miss, o.entries, threads, o.preload, r);
+      }
+    }
+  }
+  return 0;
+}
+
+static int run_child(char** argv, const std::string& table, uint32_t entries,
+                     const std::vector<unsigned>& thread_counts, const Options& o) {
+  std::string threads;
+  for (unsigned t : thread_counts) threads += (threads.empty() ? "" : ",") + std::to_string(t);
+
+  pid_t pid = ::fork();
+  if (pid < 0) die(std::string("fork: ") + std::strerror(errno));
+  if (pid == 0) {
+    ::setenv(kChildEnv, threads.c_str(), 1);
+    ::setenv("OVERRIDEHOSTS_FILE", table.c_str(), 1);
+    ::unsetenv("OVERRIDEHOSTS");
+    if (o.preload) ::setenv("LD_PRELOAD", o.lib.c_str(), 1);
+    std::string n = std::to_string(entries);
+    std::vector<char*> args;
+    args.push_back(argv[0]);
+    for (int i = 1; argv[i]; i++) args.push_back(argv[i]);
+    args.push_back((char*)"--entries");
+    args.push_back((char*)n.c_str());
+    args.push_back(nullptr);
+    ::execv("/proc/self/exe", args.data());
+    std::cerr << "resolve_bench: exec failed: " << std::strerror(errno) << "\n";
+    std::_Exit(127);
+  }
+  int status = 0;
+  while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int main(int argc, char** argv) {
+  Options o = parse_args(argc, argv);
+
+  if (const char* child = std::getenv(kChildEnv)) {
+    std::vector<unsigned> thread_counts;
+    for (const char* p = child; *p;) {
+      thread_counts.push_back((unsigned)std::strtoul(p, (char**)&p, 10));
+      if (*p == ',') p++;
+    }
+    return bench(o, thread_counts);
+  }
+
+  if (o.preload && ::access(o.lib.c_str(), R_OK) != 0) die("cannot read " + o.lib + " (use --lib)");
+  if (o.preload && o.lib.find('/') == std::string::npos) o.lib = "./" + o.lib;
+
+  std::vector<uint32_t> sizes = {o.entries};
+  std::vector<unsigned> thread_counts = {o.threads};
+  if (o.sweep) {
+    sizes = {10, 1000, 100000, 1000000};
+    thread_counts = {1, 2, 8, 32, 128};
+  }
+
+  int rc = 0;
+  for (uint32_t entries : sizes) {
+    std::string table = write_table(entries, o.name_len);
+    rc |= run_child(argv, table, entries, thread_counts, o);
+    ::unlink(table.c_str());
+  }
+  return rc;
+}
@@ -1,205 +1,2663 @@
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE
+#endif
 #include <arpa/inet.h>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <new>
 #include <atomic>
-#include <cctype>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
-#include <mutex>
+#include <ctime>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
-static std::once_flag g_init_once;
-static std::unordered_map<std::string, std::string> g_map; // hostname(lower)->ip string
+#include "overridehosts_table.h"
+#include "overridehosts_trace.h"
+
+// Set by the Makefile's baked-table target to the header tools/bake_table
+// generated; it defines overridehosts::kBakedImage.
+#ifdef OVERRIDEHOSTS_BAKED
+#include OVERRIDEHOSTS_BAKED
+#endif
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+// The upstream probe has a semaphore, which a tracer raises while it is
+// attached, so untraced misses are not timed just for the probe.
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define OVERRIDEHOSTS_USDT 1
+extern "C" {
+__attribute__((used, section(".probes"))) unsigned short overridehosts_upstream_semaphore;
+}
+#endif
+#endif
+
+// Everything else is hidden when built with -fvisibility=hidden (the
+// Makefile does), so only the interposers and the install hook get
+// dynamic symbols and internal calls bind directly.
+#define OVERRIDEHOSTS_EXPORT extern "C" __attribute__((visibility("default")))
+
+// --- freestanding runtime (make FREESTANDING=1) ---
+// Built without exceptions and linked without libstdc++, the few runtime
+// pieces the containers need come from here: global new/delete on a
+// private arena, and the __throw_* helpers, which report and abort. The
+// version script keeps all of it local, so the host program's own
+// operator new/delete is never replaced or called for our C++ objects.
+// Raw buffers (cache entries, flights, stats blocks, per-entry counters,
+// getaddrinfo_a batches) still come from libc malloc/calloc, as in the
+// default build.
+// Small blocks come from 1 MiB chunks in power-of-two classes with free
+// lists; big ones (table images, builder vectors) get their own mapping
+// and go back to the kernel on delete. Chunks are never unmapped.
+#ifdef OVERRIDEHOSTS_FREESTANDING
+static constexpr size_t kArenaChunk = 1u << 20;
+static constexpr size_t kArenaHeader = 16;   // keeps blocks 16-byte aligned
+static constexpr unsigned kArenaClasses = 13;  // 16 B .. 64 KiB
+static constexpr size_t kArenaPage = 4096;
+
+static pthread_mutex_t g_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_arena_once = PTHREAD_ONCE_INIT;
+static void* g_arena_free[kArenaClasses];  // intrusive lists, guarded by g_arena_lock
+static char* g_arena_cur;
+static char* g_arena_end;
+
+// Held across fork() so the child never inherits a half-updated list.
+static void arena_lock() { pthread_mutex_lock(&g_arena_lock); }
+static void arena_unlock() { pthread_mutex_unlock(&g_arena_lock); }
+static void arena_init() { pthread_atfork(arena_lock, arena_unlock, arena_unlock); }
+
+static void* arena_map(size_t len) {
+  void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? nullptr : p;
+}
+
+// The header holds the class for small blocks and the mapping length (at
+// least a page, so never a class) for big ones.
+static void* arena_alloc(size_t n) {
+  pthread_once(&g_arena_once, arena_init);
+  if (n > SIZE_MAX / 2) return nullptr;
+  size_t need = n + kArenaHeader;
+  if (need > (size_t)16 << (kArenaClasses - 1)) {
+    size_t len = (need + kArenaPage - 1) & ~(kArenaPage - 1);
+    char* p = (char*)arena_map(len);
+    if (!p) return nullptr;
+    *(size_t*)p = len;
+    return p + kArenaHeader;
+  }
+  unsigned k = 0;
+  while (((size_t)16 << k) < need) k++;
+  size_t size = (size_t)16 << k;
+
+  pthread_mutex_lock(&g_arena_lock);
+  char* p = (char*)g_arena_free[k];
+  if (p) {
+    g_arena_free[k] = *(void**)p;
+  } else {
+    if ((size_t)(g_arena_end - g_arena_cur) < size) {
+      char* c = (char*)arena_map(kArenaChunk);
+      if (c) { g_arena_cur = c; g_arena_end = c + kArenaChunk; }
+    }
+    if ((size_t)(g_arena_end - g_arena_cur) >= size) {
+      p = g_arena_cur;
+      g_arena_cur += size;
+    }
+  }
+  pthread_mutex_unlock(&g_arena_lock);
+  if (!p) return nullptr;
+  *(size_t*)p = k;
+  return p + kArenaHeader;
+}
+
+static void arena_free(void* q) {
+  if (!q) return;
+  char* p = (char*)q - kArenaHeader;
+  size_t v = *(size_t*)p;
+  if (v >= kArenaClasses) { munmap(p, v); return; }
+  pthread_mutex_lock(&g_arena_lock);
+  *(void**)p = g_arena_free[v];
+  g_arena_free[v] = p;
+  pthread_mutex_unlock(&g_arena_lock);
+}
+
+[[noreturn]] static void arena_fatal(const char* what) {
+  static const char kPrefix[] = "liboverridehosts: ";
+  ssize_t r = write(2, kPrefix, sizeof(kPrefix) - 1);
+  r = write(2, what, std::strlen(what));
+  r = write(2, "\n", 1);
+  (void)r;
+  abort();
+}
+
+void* operator new(size_t n) {
+  void* p = arena_alloc(n);
+  if (!p) arena_fatal("out of memory");
+  return p;
+}
+void* operator new[](size_t n) { return operator new(n); }
+void* operator new(size_t n, const std::nothrow_t&) noexcept { return arena_alloc(n); }
+void* operator new[](size_t n, const std::nothrow_t&) noexcept { return arena_alloc(n); }
+void operator delete(void* p) noexcept { arena_free(p); }
+void operator delete[](void* p) noexcept { arena_free(p); }
+void operator delete(void* p, size_t) noexcept { arena_free(p); }
+void operator delete[](void* p, size_t) noexcept { arena_free(p); }
+
+namespace std {
+const nothrow_t nothrow{};
+void __throw_bad_alloc() { arena_fatal("out of memory"); }
+void __throw_bad_array_new_length() { arena_fatal("bad array new length"); }
+void __throw_length_error(const char* what) { arena_fatal(what); }
+void __throw_logic_error(const char* what) { arena_fatal(what); }
+void __throw_out_of_range(const char* what) { arena_fatal(what); }
+void __throw_out_of_range_fmt(const char* what, ...) { arena_fatal(what); }
+}  // namespace std
+#endif
+
+using namespace overridehosts;
+
+// The next definitions of everything we interpose, resolved once by the
+// library constructor so hot paths are a plain pointer load.
+struct RealFns {
+  int (*getaddrinfo)(const char*, const char*, const struct addrinfo*, struct addrinfo**);
+  void (*freeaddrinfo)(struct addrinfo*);
+  struct hostent* (*gethostbyname)(const char*);
+  struct hostent* (*gethostbyname2)(const char*, int);
+  int (*gethostbyname_r)(const char*, struct hostent*, char*, size_t, struct hostent**, int*);
+  int (*gethostbyname2_r)(const char*, int, struct hostent*, char*, size_t, struct hostent**, int*);
+  int (*getnameinfo)(const struct sockaddr*, socklen_t, char*, socklen_t, char*, socklen_t, int);
+  struct hostent* (*gethostbyaddr)(const void*, socklen_t, int);
+  int (*gethostbyaddr_r)(const void*, socklen_t, int, struct hostent*, char*, size_t,
+                         struct hostent**, int*);
+};
+
+static RealFns g_real;
+
+static void resolve_real() {
+  auto next = [](auto& fn, const char* name) { fn = (std::remove_reference_t<decltype(fn)>)dlsym(RTLD_NEXT, name); };
+  next(g_real.getaddrinfo, "getaddrinfo");
+  next(g_real.freeaddrinfo, "freeaddrinfo");
+  next(g_real.gethostbyname, "gethostbyname");
+  next(g_real.gethostbyname2, "gethostbyname2");
+  next(g_real.gethostbyname_r, "gethostbyname_r");
+  next(g_real.gethostbyname2_r, "gethostbyname2_r");
+  next(g_real.getnameinfo, "getnameinfo");
+  next(g_real.gethostbyaddr, "gethostbyaddr");
+  next(g_real.gethostbyaddr_r, "gethostbyaddr_r");
+}
+
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
 static std::atomic<bool> g_inited{false};
 
-static std::string to_lower(std::string s) {
-  for (char& c : s) c = (char)std::tolower((unsigned char)c);
-  return s;
+// Which address a multi-address entry returns first (OVERRIDEHOSTS_POLICY).
+// The rest of the list follows in order.
+enum class Policy { Ordered, RoundRobin, Random };
+
+static Policy g_policy = Policy::Ordered;
+
+// OVERRIDEHOSTS_STATS sink: a path, or an fd as "fd:N". Both unset = off.
+static char g_stats_path[PATH_MAX];
+static int g_stats_fd = -1;
+
+// One row of the IP -> name index used by getnameinfo / gethostbyaddr.
+// v4 addresses are stored in the first 4 bytes, the rest zero.
+struct ReverseEntry {
+  int32_t family;
+  unsigned char addr[16];
+  uint32_t entry;
+
+  bool operator<(const ReverseEntry& o) const {
+    if (family != o.family) return family < o.family;
+    int c = std::memcmp(addr, o.addr, sizeof(addr));
+    return c ? c < 0 : entry < o.entry;
+  }
+};
+
+// Per-host hit counts of one stats block (thread) against one table; see
+// stat_host_hit().
+struct HostHits {
+  HostHits* next;
+  std::atomic<uint64_t> c[1];  // table.size() + 1 of them
+};
+
+// A published override table, either built on the heap from text or mapped
+// straight from OVERRIDEHOSTS_FILE (see overridehosts_table.h for the
+// layout), plus the state tied to its entry numbering. Immutable once
+// published.
+struct LoadedTable {
+  Table table;
+  std::vector<char> heap;
+  void* map = nullptr;
+  size_t map_size = 0;
+  std::atomic<uint32_t>* rr = nullptr;  // per entry, for Policy::RoundRobin
+  mutable std::vector<ReverseEntry> reverse;  // sorted; exact names only; see reverse_index()
+  mutable std::atomic<bool> reverse_ready{false};
+  mutable std::atomic<HostHits*> hits{nullptr};  // one per counting thread
+  struct stat st{};                     // of the file it came from
+  uint64_t gen = 0;                     // set by publish(), never reused
+
+  ~LoadedTable() {
+    if (map) munmap(map, map_size);
+    free(rr);
+    for (HostHits* h = hits.load(std::memory_order_relaxed); h;) {
+      HostHits* next = h->next;
+      free(h);
+      h = next;
+    }
+  }
+};
+
+// --- table publication ---
+// Without OVERRIDEHOSTS_RELOAD or an installed table (overridehosts.h)
+// g_current never changes and readers use it as is. Otherwise it is
+// tagged kPinned and readers pin a table by bumping one of two striped
+// counters for the current epoch; a writer swaps the pointer, then flips
+// the epoch twice, each time waiting for the counters of the epoch it
+// left to drain, so every reader that could still hold the old table is
+// gone before it is freed. Readers never lock or wait.
+static constexpr unsigned kReaderStripes = 16;
+static constexpr uintptr_t kPinned = 1;
+
+struct alignas(64) ReaderCount {
+  std::atomic<long> n{0};
+};
+
+static std::atomic<uintptr_t> g_current{0};  // LoadedTable*, | kPinned
+static bool g_reload = false;
+static std::atomic<bool> g_installed{false};
+static std::atomic<unsigned> g_epoch{0};
+static ReaderCount g_readers[2][kReaderStripes];
+static std::atomic<unsigned> g_next_stripe{0};
+static pthread_mutex_t g_publish_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t g_generation;  // guarded by g_publish_lock
+
+static unsigned reader_stripe() {
+  static thread_local unsigned stripe = g_next_stripe.fetch_add(1, std::memory_order_relaxed) % kReaderStripes;
+  return stripe;
+}
+
+struct TableRef {
+  const LoadedTable* t;
+  std::atomic<long>* pin = nullptr;
+
+  TableRef() {
+    uintptr_t p = g_current.load(std::memory_order_acquire);
+    if (!(p & kPinned)) {
+      t = (const LoadedTable*)p;
+      return;
+    }
+    pin = &g_readers[g_epoch.load() & 1][reader_stripe()].n;
+    pin->fetch_add(1);
+    t = (const LoadedTable*)(g_current.load() & ~kPinned);
+  }
+  ~TableRef() {
+    if (pin) pin->fetch_sub(1, std::memory_order_release);
+  }
+  TableRef(const TableRef&) = delete;
+  TableRef& operator=(const TableRef&) = delete;
+};
+
+static void drain_readers(unsigned epoch) {
+  for (unsigned spins = 0;; spins++) {
+    long n = 0;
+    for (ReaderCount& c : g_readers[epoch & 1]) n += c.n.load();
+    if (n == 0) return;
+    // Pins cover the table work of one call and are dropped before any
+    // upstream call or callback. The long ones are a descheduled reader,
+    // the first reverse lookup building its index and a stats dump
+    // writing host counts to a slow sink, so back off to sleeping.
+    if (spins < 64) sched_yield();
+    else usleep(1000);
+  }
+}
+
+// A table published unpinned was read without pins and is never freed;
+// that only happens once, at init.
+static void publish(LoadedTable* t, bool pinned) {
+  pthread_mutex_lock(&g_publish_lock);
+  t->gen = ++g_generation;
+  uintptr_t old = g_current.exchange((uintptr_t)t | (pinned ? kPinned : 0));
+  if (old & kPinned) {
+    drain_readers(g_epoch.fetch_add(1));
+    drain_readers(g_epoch.fetch_add(1));
+    delete (LoadedTable*)(old & ~kPinned);
+  }
+  pthread_mutex_unlock(&g_publish_lock);
+}
+
+static void parse_policy_env() {
+  const char* p = std::getenv("OVERRIDEHOSTS_POLICY");
+  if (!p) return;
+  std::string_view s(p);
+  if (s == "roundrobin" || s == "rr") g_policy = Policy::RoundRobin;
+  else if (s == "random") g_policy = Policy::Random;
+}
+
+// Mapping text, or the wrapper's pre-validated canonical encoding.
+static void build_from_text(LoadedTable& t, std::string_view text) {
+  TableBuilder b;
+  if (is_canonical(text)) b.add_canonical(text);
+  else b.add_text(text);
+  t.heap = b.finish();
+  t.table = Table(t.heap.data());
+}
+
+// OVERRIDEHOSTS_FILE holds either an image from `overridehosts --compile`,
+// which is mapped read-only and used in place, or plain mapping text.
+static bool load_map_file(LoadedTable& t, const char* path) {
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  if (fstat(fd, &t.st) != 0 || t.st.st_size <= 0) { ::close(fd); return false; }
+
+  size_t size = (size_t)t.st.st_size;
+  void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) return false;
+
+  if (Table::valid(p, size)) {
+    t.map = p;
+    t.map_size = size;
+    t.table = Table(p);
+    return true;
+  }
+  bool text = size < sizeof(kImageMagic) || std::memcmp(p, kImageMagic, sizeof(kImageMagic)) != 0;
+  if (text) build_from_text(t, std::string_view((const char*)p, size));
+  munmap(p, size);
+  return text;
+}
+
+#ifndef OVERRIDEHOSTS_BAKED
+// OVERRIDEHOSTS_FD="<fd>,<hash>" names a sealed memfd holding the image the
+// wrapper built from OVERRIDEHOSTS, inherited across exec so descendants map
+// it instead of parsing. <hash> is text_hash() of that OVERRIDEHOSTS value,
+// or "-" when the list was too large for the environment and only the fd
+// carries it. A changed OVERRIDEHOSTS, or an fd that was closed and reused
+// for something else, fails the checks and we fall back to the text.
+static bool load_memfd(LoadedTable& t, const char* spec, const char* text) {
+  char* end;
+  long fd = std::strtol(spec, &end, 10);
+  if (end == spec || *end != ',' || fd < 0 || fd > INT_MAX) return false;
+  const char* h = end + 1;
+  if (text) {
+    uint64_t want = std::strtoull(h, &end, 16);
+    if (end == h || *end || want != text_hash(text)) return false;
+  } else if (std::strcmp(h, "-") != 0) {
+    return false;
+  }
+
+  const int need = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+  int seals = fcntl((int)fd, F_GET_SEALS);
+  if (seals < 0 || (seals & need) != need) return false;
+  struct stat st;
+  if (fstat((int)fd, &st) != 0 || st.st_size <= 0) return false;
+
+  size_t size = (size_t)st.st_size;
+  void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, (int)fd, 0);
+  if (p == MAP_FAILED) return false;
+  if (!Table::valid(p, size)) {
+    munmap(p, size);
+    return false;
+  }
+  t.map = p;
+  t.map_size = size;
+  t.table = Table(p);
+  return true;
+}
+#endif
+
+// Suffix rules have no single name to answer with, so only entries
+// reachable from the hash slots go into the reverse index.
+static void build_reverse(const LoadedTable& t) {
+  const Table& tb = t.table;
+  for (uint32_t i = 0; i < tb.h->slot_count; i++) {
+    if (!tb.slots[i]) continue;
+    uint32_t idx = tb.slots[i] - 1;
+    const HostEntry& e = tb.entries[idx];
+    for (uint32_t a = 0; a < e.addr_count; a++) {
+      const HostAddr& addr = tb.addrs[e.addr_first + a];
+      ReverseEntry r{addr.family, {}, idx};
+      if (addr.family == AF_INET) std::memcpy(r.addr, &addr.v4, sizeof(in_addr));
+      else std::memcpy(r.addr, &addr.v6, sizeof(in6_addr));
+      t.reverse.push_back(r);
+    }
+  }
+  // Ties go to the entry listed first.
+  std::sort(t.reverse.begin(), t.reverse.end());
+}
+
+static void finish_table(LoadedTable& t) {
+  if (g_policy == Policy::RoundRobin)
+    // calloc so a large mapped table only touches the counters it uses.
+    t.rr = (std::atomic<uint32_t>*)calloc(t.table.size() + 1, sizeof(std::atomic<uint32_t>));
+}
+
+// The IP -> name index is built on the first reverse lookup rather than at
+// load, so processes that never do one (most) do not pay for it.
+static pthread_mutex_t g_reverse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const std::vector<ReverseEntry>& reverse_index(const LoadedTable& t) {
+  if (t.reverse_ready.load(std::memory_order_acquire)) return t.reverse;
+  pthread_mutex_lock(&g_reverse_lock);
+  if (!t.reverse_ready.load(std::memory_order_relaxed)) {
+    build_reverse(t);
+    t.reverse_ready.store(true, std::memory_order_release);
+  }
+  pthread_mutex_unlock(&g_reverse_lock);
+  return t.reverse;
+}
+
+// --- live reload (OVERRIDEHOSTS_RELOAD=1) ---
+// A background thread watches OVERRIDEHOSTS_FILE's directory with inotify
+// (so editors' and ConfigMap-style rename-into-place updates are seen) and
+// also re-stats the file every second. A changed file is loaded off the hot
+// path and published; a missing or broken file keeps the current table.
+static const char* g_reload_path;
+static std::atomic<bool> g_watching{false};
+
+static bool same_file(const struct stat& a, const struct stat& b) {
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size &&
+         a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+static void* reload_main(void*) {
+  if (!g_reload_path) return nullptr;
+  char dir[PATH_MAX];
+  const char* slash = std::strrchr(g_reload_path, '/');
+  size_t len = !slash ? 0 : slash == g_reload_path ? 1 : (size_t)(slash - g_reload_path);
+  if (len >= sizeof(dir)) len = 0;
+  std::memcpy(dir, len ? g_reload_path : ".", len ? len : 1);
+  dir[len ? len : 1] = 0;
+
+  int in = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (in >= 0) inotify_add_watch(in, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+
+  // Our own copy of what the current table was loaded from: an install()
+  // may retire and free that table at any time.
+  struct stat loaded;
+  {
+    TableRef ref;
+    loaded = ref.t->st;
+  }
+
+  for (;;) {
+    if (in >= 0) {
+      pollfd pfd{in, POLLIN, 0};
+      if (poll(&pfd, 1, 1000) > 0) {
+        char buf[4096];
+        while (read(in, buf, sizeof(buf)) > 0) {}
+        usleep(20000);  // let a burst of writes settle
+      }
+    } else {
+      sleep(1);
+    }
+
+    struct stat st;
+    if (stat(g_reload_path, &st) != 0) continue;
+    if (g_installed.load(std::memory_order_relaxed) || same_file(st, loaded)) continue;
+
+    LoadedTable* t = new LoadedTable;
+    if (!load_map_file(*t, g_reload_path)) { delete t; continue; }
+    finish_table(*t);
+    loaded = t->st;
+    publish(t, true);
+  }
+  return nullptr;
+}
+
+static void start_watcher() {
+  if (g_watching.exchange(true)) return;
+
+  // Keep the application's signals off this thread.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t tid;
+  if (pthread_create(&tid, &attr, reload_main, nullptr) != 0) g_watching.store(false);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+// The watcher does not survive fork(), and neither do the readers counted
+// in g_readers or a writer inside publish(), so a child starts from a
+// clean slate and a new watcher.
+static void reload_atfork_child() {
+  for (auto& epoch : g_readers)
+    for (ReaderCount& c : epoch) c.n.store(0, std::memory_order_relaxed);
+  pthread_mutex_init(&g_publish_lock, nullptr);
+  pthread_mutex_init(&g_reverse_lock, nullptr);
+  g_watching.store(false, std::memory_order_relaxed);
+}
+
+// --- statistics (OVERRIDEHOSTS_STATS) ---
+// Each thread counts into its own cache-line-aligned block with plain
+// relaxed load/store, so the lookup path never contends. Blocks live on a
+// lock-free list and are summed when read; a thread's block is handed to
+// the next new thread when it exits, which keeps its counts in the totals.
+// Per-host hit counts are per block too, one array per table a block has
+// hit (LoadedTable::hits), so they count from the time that table was
+// loaded and go away with it.
+enum Stat : unsigned {
+  kStatHits,
+  kStatMisses,
+  kStatReverseHits,
+  kStatReverseMisses,
+  kStatUpstreamCalls,
+  kStatUpstreamErrors,
+  kStatUpstreamNs,
+  kStatCacheHits,
+  kStatCoalesced,
+  kStatCount
+};
+
+struct alignas(64) StatBlock {
+  std::atomic<uint64_t> c[kStatCount];
+  std::atomic<bool> in_use;
+  StatBlock* next;
+  HostHits* hits;  // of the table with generation hits_gen; owner only
+  uint64_t hits_gen;
+};
+
+static bool g_stats;
+static std::atomic<StatBlock*> g_stat_blocks{nullptr};
+static pthread_key_t g_stat_key;
+static thread_local StatBlock* t_stats;
+
+static void stat_release(void* p) { ((StatBlock*)p)->in_use.store(false, std::memory_order_release); }
+
+static StatBlock* stat_block() {
+  if (t_stats) return t_stats;
+  StatBlock* b = g_stat_blocks.load(std::memory_order_acquire);
+  for (; b; b = b->next) {
+    bool idle = false;
+    if (b->in_use.compare_exchange_strong(idle, true, std::memory_order_acquire)) break;
+  }
+  if (!b) {
+    b = (StatBlock*)calloc(1, sizeof(StatBlock));
+    if (!b) return nullptr;
+    b->in_use.store(true, std::memory_order_relaxed);
+    b->next = g_stat_blocks.load(std::memory_order_relaxed);
+    while (!g_stat_blocks.compare_exchange_weak(b->next, b, std::memory_order_release)) {}
+  }
+  pthread_setspecific(g_stat_key, b);
+  return t_stats = b;
+}
+
+static inline void stat_add(Stat s, uint64_t n = 1) {
+  if (!g_stats) return;
+  StatBlock* b = stat_block();
+  if (b) b->c[s].store(b->c[s].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Generations are never reused, so a block's array is only touched while
+// its table is alive; calloc so a large table only costs the pages a
+// thread actually hits.
+static void stat_host_hit(const LoadedTable& t, uint32_t i) {
+  StatBlock* b = stat_block();
+  if (!b) return;
+  if (b->hits_gen != t.gen) {
+    HostHits* h = (HostHits*)calloc(1, sizeof(HostHits) + t.table.size() * sizeof(std::atomic<uint64_t>));
+    if (!h) return;
+    h->next = t.hits.load(std::memory_order_relaxed);
+    while (!t.hits.compare_exchange_weak(h->next, h, std::memory_order_release)) {}
+    b->hits = h;
+    b->hits_gen = t.gen;
+  }
+  b->hits->c[i].store(b->hits->c[i].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+static inline uint64_t clock_ns(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void stat_upstream(uint64_t duration_ns, bool failed) {
+  if (!g_stats) return;
+  stat_add(kStatUpstreamCalls);
+  stat_add(kStatUpstreamNs, duration_ns);
+  if (failed) stat_add(kStatUpstreamErrors);
+}
+
+// Buffered writer for the dump. Only async-signal-safe calls, so the
+// SIGUSR2 handler can use it directly.
+struct StatOut {
+  int fd;
+  size_t n = 0;
+  char buf[4096];
+
+  void flush() {
+    for (size_t off = 0; off < n;) {
+      ssize_t w = write(fd, buf + off, n - off);
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) break;
+      off += (size_t)w;
+    }
+    n = 0;
+  }
+  void put(std::string_view s) {
+    for (char c : s) {
+      if (n == sizeof(buf)) flush();
+      buf[n++] = c;
+    }
+  }
+  void num(uint64_t v) {
+    char tmp[24];
+    size_t i = sizeof(tmp);
+    do tmp[--i] = (char)('0' + v % 10); while (v /= 10);
+    put(std::string_view(tmp + i, sizeof(tmp) - i));
+  }
+  void seconds(uint64_t ns) {
+    num(ns / 1000000000ull);
+    put(".");
+    char frac[9];
+    for (int i = 8; i >= 0; i--, ns /= 10) frac[i] = (char)('0' + ns % 10);
+    put(std::string_view(frac, 9));
+  }
+  void metric(const char* name, const char* labels, uint64_t v) {
+    put(name);
+    put(labels);
+    put(" ");
+    num(v);
+    put("\n");
+  }
+};
+
+static void stats_write(int fd) {
+  uint64_t sum[kStatCount] = {};
+  for (StatBlock* b = g_stat_blocks.load(std::memory_order_acquire); b; b = b->next)
+    for (unsigned i = 0; i < kStatCount; i++) sum[i] += b->c[i].load(std::memory_order_relaxed);
+
+  StatOut o;
+  o.fd = fd;
+  o.put("# TYPE overridehosts_lookups_total counter\n");
+  o.metric("overridehosts_lookups_total", "{kind=\"forward\",result=\"hit\"}", sum[kStatHits]);
+  o.metric("overridehosts_lookups_total", "{kind=\"forward\",result=\"miss\"}", sum[kStatMisses]);
+  o.metric("overridehosts_lookups_total", "{kind=\"reverse\",result=\"hit\"}", sum[kStatReverseHits]);
+  o.metric("overridehosts_lookups_total", "{kind=\"reverse\",result=\"miss\"}", sum[kStatReverseMisses]);
+  o.put("# TYPE overridehosts_upstream_calls_total counter\n");
+  o.metric("overridehosts_upstream_calls_total", "", sum[kStatUpstreamCalls]);
+  o.put("# TYPE overridehosts_upstream_errors_total counter\n");
+  o.metric("overridehosts_upstream_errors_total", "", sum[kStatUpstreamErrors]);
+  o.put("# TYPE overridehosts_upstream_seconds_total counter\n");
+  o.put("overridehosts_upstream_seconds_total ");
+  o.seconds(sum[kStatUpstreamNs]);
+  o.put("\n");
+  o.put("# TYPE overridehosts_cache_hits_total counter\n");
+  o.metric("overridehosts_cache_hits_total", "", sum[kStatCacheHits]);
+  o.put("# TYPE overridehosts_coalesced_total counter\n");
+  o.metric("overridehosts_coalesced_total", "", sum[kStatCoalesced]);
+
+  o.put("# TYPE overridehosts_host_hits_total counter\n");
+  {
+    TableRef ref;
+    const LoadedTable& t = *ref.t;
+    HostHits* first = t.hits.load(std::memory_order_acquire);
+    for (uint32_t i = 0; first && i < t.table.size(); i++) {
+      uint64_t v = 0;
+      for (HostHits* h = first; h; h = h->next) v += h->c[i].load(std::memory_order_relaxed);
+      if (!v) continue;
+      o.put("overridehosts_host_hits_total{host=\"");
+      for (char c : t.table.name(t.table.entries[i])) {
+        if (c == '"' || c == '\\') o.put("\\");
+        o.put(std::string_view(&c, 1));
+      }
+      o.put("\"} ");
+      o.num(v);
+      o.put("\n");
+    }
+  }
+  o.flush();
+}
+
+// Path sinks are rewritten through a temp file and rename() so a scraper
+// never sees a half-written dump. Only the process that read
+// OVERRIDEHOSTS_STATS dumps: forked children inherit the atexit handler,
+// the sink and the temp name, and would overwrite it with their counts.
+static char g_stats_tmp[PATH_MAX];
+static pid_t g_stats_owner;
+
+static void stats_dump() {
+  if (getpid() != g_stats_owner) return;
+  if (g_stats_fd >= 0) {
+    stats_write(g_stats_fd);
+    return;
+  }
+  int fd = open(g_stats_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return;
+  stats_write(fd);
+  close(fd);
+  rename(g_stats_tmp, g_stats_path);
+}
+
+static void stats_on_signal(int) {
+  int saved = errno;
+  stats_dump();
+  errno = saved;
+}
+
+static void stats_init_env() {
+  const char* v = std::getenv("OVERRIDEHOSTS_STATS");
+  if (!v || !*v) return;
+  if (std::strncmp(v, "fd:", 3) == 0) {
+    char* end;
+    long fd = std::strtol(v + 3, &end, 10);
+    if (*end || fd < 0 || fd > INT_MAX) return;
+    g_stats_fd = (int)fd;
+  } else {
+    size_t len = std::strlen(v);
+    if (len + 5 > sizeof(g_stats_path)) return;
+    std::memcpy(g_stats_path, v, len + 1);
+    std::memcpy(g_stats_tmp, v, len);
+    std::memcpy(g_stats_tmp + len, ".tmp", 5);
+  }
+  if (pthread_key_create(&g_stat_key, stat_release) != 0) {
+    g_stats_fd = -1;
+    g_stats_path[0] = 0;
+    return;
+  }
+  g_stats = true;
+  g_stats_owner = getpid();
+  atexit(stats_dump);
+
+  // Leave SIGUSR2 alone if the application already handles it.
+  struct sigaction old;
+  if (sigaction(SIGUSR2, nullptr, &old) == 0 && old.sa_handler == SIG_DFL && !(old.sa_flags & SA_SIGINFO)) {
+    struct sigaction sa{};
+    sa.sa_handler = stats_on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, nullptr);
+  }
+}
+
+// --- upstream trace ring (OVERRIDEHOSTS_TRACE) ---
+// OVERRIDEHOSTS_TRACE=1 (or a record count) publishes one record per real
+// getaddrinfo() call into a shared-memory ring that `overridehosts --trace
+// <pid>` drains; layout in overridehosts_trace.h. Built with <sys/sdt.h>
+// available, the same calls also fire the overridehosts:upstream USDT
+// probe (node, rc, duration_ns). The ring belongs to the process that
+// created it: a forked child stops writing to it and never unlinks it.
+static TraceHeader* g_trace;
+static size_t g_trace_bytes;
+static pid_t g_trace_owner;
+static char g_trace_name[64];
+
+static void trace_unlink() {
+  if (getpid() == g_trace_owner) shm_unlink(g_trace_name);
+}
+
+static void trace_atfork_child() {
+  if (!g_trace) return;
+  munmap(g_trace, g_trace_bytes);
+  g_trace = nullptr;
+}
+
+static void trace_init_env() {
+  const char* v = std::getenv("OVERRIDEHOSTS_TRACE");
+  if (!v || !*v || std::strcmp(v, "0") == 0) return;
+  char* end;
+  unsigned long want = std::strtoul(v, &end, 10);
+  if (*end) return;
+  uint32_t cap = kTraceDefaultRecords;
+  if (want > 1) {
+    cap = 1;
+    while (cap < want && cap < kTraceMaxRecords) cap <<= 1;
+  }
+
+  trace_shm_name((long)getpid(), g_trace_name, sizeof(g_trace_name));
+  int fd = shm_open(g_trace_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) return;
+  size_t bytes = trace_bytes(cap);
+  void* p = ftruncate(fd, (off_t)bytes) == 0
+      ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+      : MAP_FAILED;
+  close(fd);
+  if (p == MAP_FAILED) {
+    shm_unlink(g_trace_name);
+    return;
+  }
+
+  TraceHeader* h = (TraceHeader*)p;
+  h->version = kTraceVersion;
+  h->capacity = cap;
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(h->magic, kTraceMagic, sizeof(kTraceMagic));
+  g_trace = h;
+  g_trace_bytes = bytes;
+  g_trace_owner = getpid();
+  atexit(trace_unlink);
+  pthread_atfork(nullptr, nullptr, trace_atfork_child);
+}
+
+static inline void trace_upstream(const char* node, int rc, uint64_t duration_ns) {
+#ifdef OVERRIDEHOSTS_USDT
+  DTRACE_PROBE3(overridehosts, upstream, node, rc, duration_ns);
+#endif
+  size_t len;
+  if (g_trace) trace_write(g_trace, clock_ns(CLOCK_REALTIME), duration_ns, hash_cstr(node, len), rc);
+}
+
+// OVERRIDEHOSTS wins when set, so the README's "adjust inside shell"
+// workflow keeps working under an inherited OVERRIDEHOSTS_FILE.
+static void cache_init_env();
+static void coalesce_init_env();
+static void ares_init_env();
+
+static void parse_map_env() {
+  parse_policy_env();
+  stats_init_env();
+  trace_init_env();
+  cache_init_env();
+  coalesce_init_env();
+  ares_init_env();
+  LoadedTable* t = new LoadedTable;
+#ifdef OVERRIDEHOSTS_BAKED
+  // Compiled in by tools/bake_table and used in place from .rodata;
+  // OVERRIDEHOSTS, OVERRIDEHOSTS_FD and OVERRIDEHOSTS_FILE are ignored.
+  t->table = Table(kBakedImage);
+#else
+  const char* env = std::getenv("OVERRIDEHOSTS");
+  const char* memfd = std::getenv("OVERRIDEHOSTS_FD");
+  const char* file = std::getenv("OVERRIDEHOSTS_FILE");
+  const char* reload = std::getenv("OVERRIDEHOSTS_RELOAD");
+
+  if (env && *env) {
+    if (!(memfd && load_memfd(*t, memfd, env))) build_from_text(*t, env);
+  } else if (!(memfd && load_memfd(*t, memfd, nullptr)) && file && *file) {
+    load_map_file(*t, file);
+    if (reload && *reload && *reload != '0') {
+      g_reload_path = file;
+      g_reload = true;
+    }
+  }
+#endif
+  pthread_atfork(nullptr, nullptr, reload_atfork_child);
+  finish_table(*t);
+  if (g_policy == Policy::RoundRobin && !t->rr) g_policy = Policy::Ordered;
+  publish(t, g_reload);
+}
+
+static void init_once() {
+  resolve_real();
+  parse_map_env();
+  g_inited.store(true, std::memory_order_release);
+}
+
+// Normally everything is set up here, before main(). Interposers still go
+// through ensure_inited() for calls made by constructors that run first.
+__attribute__((constructor)) static void overridehosts_init() {
+  pthread_once(&g_init_once, init_once);
+}
+
+static inline void ensure_inited() {
+  if (__builtin_expect(!g_inited.load(std::memory_order_acquire), 0)) pthread_once(&g_init_once, init_once);
+  if (g_reload && !g_watching.load(std::memory_order_relaxed)) start_watcher();
+}
+
+// --- installed tables (overridehosts.h) ---
+// HostOverrideTable::install() finds this with dlsym() and hands over every
+// image it publishes. We keep a private copy, so the caller may free its
+// own right away; from then on the reload watcher leaves the table alone.
+OVERRIDEHOSTS_EXPORT int overridehosts_install_image(const void* image, size_t size) {
+  ensure_inited();
+  LoadedTable* t = new (std::nothrow) LoadedTable;
+  if (!t) return ENOMEM;
+#if __cpp_exceptions
+  try {
+    t->heap.assign((const char*)image, (const char*)image + size);
+  } catch (const std::bad_alloc&) {
+    delete t;
+    return ENOMEM;
+  }
+#else
+  t->heap.assign((const char*)image, (const char*)image + size);  // aborts if out of memory
+#endif
+  if (!Table::valid(t->heap.data(), t->heap.size())) {
+    delete t;
+    return EINVAL;
+  }
+  t->table = Table(t->heap.data());
+  finish_table(*t);
+  g_installed.store(true, std::memory_order_relaxed);
+  publish(t, true);
+  return 0;
+}
+
+// --- per-thread lookup memo ---
+// Hot loops resolve the same few names over and over. Each thread keeps
+// its last answers (entry or miss) for short names in a small
+// direct-mapped memo tagged with the generation of the table they came
+// from, so a repeat costs a strlen and a memcmp instead of folding,
+// hashing and probing. Names are compared as given, not folded.
+static constexpr unsigned kMemoWays = 8;
+static constexpr size_t kMemoName = 64;
+
+struct NameMemo {
+  uint64_t gen;  // 0 = empty
+  const HostEntry* e;
+  uint32_t len;
+  char name[kMemoName];
+};
+
+static thread_local NameMemo t_memo[kMemoWays];
+
+static const HostEntry* memo_lookup(const char* node, const LoadedTable& t) {
+  size_t n = std::strlen(node);
+  if (n >= kMemoName) return t.table.lookup(node);
+  unsigned way = ((unsigned)n ^ (unsigned char)node[0] * 7u ^ (unsigned char)node[n - 1] * 13u) % kMemoWays;
+  NameMemo& m = t_memo[way];
+  if (m.gen == t.gen && m.len == n && std::memcmp(m.name, node, n) == 0) return m.e;
+
+  const HostEntry* e = t.table.lookup(node);
+  m.gen = t.gen;
+  m.e = e;
+  m.len = (uint32_t)n;
+  std::memcpy(m.name, node, n);
+  return e;
+}
+
+static const HostEntry* lookup_ip_for(const char* node, TableRef& ref) {
+  if (!node || !*node) return nullptr;
+  const HostEntry* e = memo_lookup(node, *ref.t);
+  if (g_stats) {
+    stat_add(e ? kStatHits : kStatMisses);
+    if (e) stat_host_hit(*ref.t, ref.t->table.index(e));
+  }
+  return e;
+}
+
+// Entry owning an overridden address, for reverse lookups. v4-mapped v6
+// addresses are looked up as v4.
+static const HostEntry* lookup_name_for(int af, const void* addr, TableRef& ref) {
+  ReverseEntry key{af, {}, 0};
+  if (af == AF_INET) {
+    std::memcpy(key.addr, addr, sizeof(in_addr));
+  } else if (af == AF_INET6) {
+    if (IN6_IS_ADDR_V4MAPPED((const in6_addr*)addr)) {
+      key.family = AF_INET;
+      std::memcpy(key.addr, (const unsigned char*)addr + 12, sizeof(in_addr));
+    } else {
+      std::memcpy(key.addr, addr, sizeof(in6_addr));
+    }
+  } else {
+    return nullptr;
+  }
+
+  const std::vector<ReverseEntry>& rev = reverse_index(*ref.t);
+  auto it = std::lower_bound(rev.begin(), rev.end(), key);
+  bool hit = it != rev.end() && it->family == key.family && std::memcmp(it->addr, key.addr, sizeof(key.addr)) == 0;
+  stat_add(hit ? kStatReverseHits : kStatReverseMisses);
+  return hit ? &ref.t->table.entries[it->entry] : nullptr;
+}
+
+static uint32_t next_random() {
+  static thread_local uint64_t state;
+  if (!state) state = (uint64_t)(uintptr_t)&state ^ ((uint64_t)time(nullptr) << 32) ^ 0x9e3779b97f4a7c15ull;
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return (uint32_t)((state * 0x2545f4914f6cdd1dull) >> 32);
+}
+
+// Index of the address an entry returns first under g_policy.
+static uint32_t pick_first(const LoadedTable& t, const HostEntry& e) {
+  if (g_policy == Policy::Ordered || e.addr_count < 2) return 0;
+  // finish_table() leaves rr null if calloc failed; such a table is ordered.
+  if (g_policy == Policy::RoundRobin && !t.rr) return 0;
+  uint32_t n = e.sched_count ? e.sched_count : e.addr_count;
+  uint32_t r = g_policy == Policy::RoundRobin
+      ? t.rr[t.table.index(&e)].fetch_add(1, std::memory_order_relaxed)
+      : next_random();
+  r %= n;
+  return e.sched_count ? t.table.sched[e.sched_first + r] : r;
+}
+
+// --- service -> port ---
+// /etc/services is read once, on the first non-numeric service, into a table
+// sorted by (name, protocol). Aliases get their own rows.
+struct ServiceEntry {
+  std::string_view name;
+  int protocol;
+  uint16_t port;  // network order
+};
+
+static pthread_once_t g_services_once = PTHREAD_ONCE_INIT;
+static std::vector<char> g_services_text;
+static std::vector<ServiceEntry> g_services;
+
+static bool service_less(const ServiceEntry& a, const ServiceEntry& b) {
+  return a.name != b.name ? a.name < b.name : a.protocol < b.protocol;
+}
+
+static void load_services() {
+  int fd = ::open("/etc/services", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  char buf[4096];
+  ssize_t n;
+  while ((n = ::read(fd, buf, sizeof(buf))) > 0) g_services_text.insert(g_services_text.end(), buf, buf + n);
+  ::close(fd);
+
+  std::string_view all(g_services_text.data(), g_services_text.size());
+  while (!all.empty()) {
+    size_t j = all.find('\n');
+    std::string_view line = all.substr(0, j);
+    all = (j == std::string_view::npos) ? std::string_view() : all.substr(j + 1);
+    line = line.substr(0, line.find('#'));
+
+    // name port/proto [aliases...]
+    std::string_view tok[16];
+    size_t ntok = 0;
+    while (ntok < 16) {
+      line = trim(line);
+      if (line.empty()) break;
+      size_t k = 0;
+      while (k < line.size() && !is_space(line[k])) k++;
+      tok[ntok++] = line.substr(0, k);
+      line.remove_prefix(k);
+    }
+    if (ntok < 2) continue;
+
+    size_t slash = tok[1].find('/');
+    if (slash == std::string_view::npos) continue;
+    std::string_view proto = tok[1].substr(slash + 1);
+    int protocol = proto == "tcp" ? IPPROTO_TCP : proto == "udp" ? IPPROTO_UDP : 0;
+    unsigned long port = 0;
+    size_t k = 0;
+    for (; k < slash && tok[1][k] >= '0' && tok[1][k] <= '9' && port <= 65535; k++) port = port * 10 + (tok[1][k] - '0');
+    if (!protocol || k == 0 || k != slash || port > 65535) continue;
+
+    for (size_t t = 0; t < ntok; t++) {
+      if (t == 1) continue;
+      g_services.push_back({tok[t], protocol, htons((uint16_t)port)});
+    }
+  }
+  std::sort(g_services.begin(), g_services.end(), service_less);
+}
+
+static bool lookup_service(std::string_view name, int protocol, uint16_t& port) {
+  pthread_once(&g_services_once, load_services);
+  ServiceEntry key{name, protocol, 0};
+  auto it = std::lower_bound(g_services.begin(), g_services.end(), key, service_less);
+  if (it == g_services.end() || it->name != name || it->protocol != protocol) return false;
+  port = it->port;
+  return true;
+}
+
+// Ports for each protocol, network order; -1 when the service does not exist
+// for that protocol.
+struct ServicePorts {
+  bool given;
+  int tcp;
+  int udp;
+};
+
+static int resolve_service(const char* service, int flags, ServicePorts& out) {
+  out = {false, 0, 0};
+  if (!service || !*service) return 0;
+  out.given = true;
+
+  unsigned long port = 0;
+  const char* p = service;
+  for (; *p >= '0' && *p <= '9' && port <= 65535; p++) port = port * 10 + (*p - '0');
+  if (!*p && port <= 65535) {
+    out.tcp = out.udp = htons((uint16_t)port);
+    return 0;
+  }
+  if (flags & AI_NUMERICSERV) return EAI_NONAME;
+
+  uint16_t tcp = 0, udp = 0;
+  out.tcp = lookup_service(service, IPPROTO_TCP, tcp) ? tcp : -1;
+  out.udp = lookup_service(service, IPPROTO_UDP, udp) ? udp : -1;
+  return (out.tcp < 0 && out.udp < 0) ? EAI_SERVICE : 0;
+}
+
+// --- addrinfo results ---
+// Socket types returned for ai_socktype == 0, in glibc's order. SOCK_RAW has
+// no ports and is left out when a service is given.
+struct SockKind {
+  int socktype;
+  int protocol;
+};
+
+static const SockKind kSockKinds[] = {
+  {SOCK_STREAM, IPPROTO_TCP},
+  {SOCK_DGRAM, IPPROTO_UDP},
+  {SOCK_RAW, 0},
+};
+
+// --- AI_ADDRCONFIG ---
+// Which families have a non-loopback address configured, as glibc decides
+// it. getifaddrs() is a netlink round trip, so the answer is kept for a few
+// seconds; one thread refreshes it while the others use the old value.
+static constexpr uint64_t kAddrconfigTtlNs = 5000000000ull;
+static constexpr unsigned kSeenV4 = 1, kSeenV6 = 2;
+
+static std::atomic<uint64_t> g_addrconfig_at{0};
+static std::atomic<unsigned> g_addrconfig_seen{0};
+static pthread_mutex_t g_addrconfig_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned addrconfig_seen() {
+  uint64_t now = now_ns();
+  uint64_t at = g_addrconfig_at.load(std::memory_order_acquire);
+  if (at && now - at < kAddrconfigTtlNs) return g_addrconfig_seen.load(std::memory_order_relaxed);
+  if (at ? pthread_mutex_trylock(&g_addrconfig_lock) != 0 : pthread_mutex_lock(&g_addrconfig_lock) != 0)
+    return g_addrconfig_seen.load(std::memory_order_relaxed);
+
+  if (g_addrconfig_at.load(std::memory_order_relaxed) == at) {
+    unsigned seen = 0;
+    ifaddrs* ifa = nullptr;
+    if (getifaddrs(&ifa) == 0) {
+      for (ifaddrs* i = ifa; i; i = i->ifa_next) {
+        if (!i->ifa_addr) continue;
+        if (i->ifa_addr->sa_family == AF_INET &&
+            ((sockaddr_in*)i->ifa_addr)->sin_addr.s_addr != htonl(INADDR_LOOPBACK))
+          seen |= kSeenV4;
+        else if (i->ifa_addr->sa_family == AF_INET6 &&
+                 !IN6_IS_ADDR_LOOPBACK(&((sockaddr_in6*)i->ifa_addr)->sin6_addr))
+          seen |= kSeenV6;
+      }
+      freeifaddrs(ifa);
+    }
+    g_addrconfig_seen.store(seen, std::memory_order_relaxed);
+    g_addrconfig_at.store(now ? now : 1, std::memory_order_release);
+  }
+  unsigned seen = g_addrconfig_seen.load(std::memory_order_relaxed);
+  pthread_mutex_unlock(&g_addrconfig_lock);
+  return seen;
+}
+
+// --- result pool ---
+// Override results live in fixed-size slots carved out of one reserved
+// mapping, so a whole addrinfo list is a single block and freeaddrinfo() can
+// tell ours from libc's with a range check. Each thread keeps a few free
+// slots; overflow and thread exit hand them back to a global list. A slot
+// holds the largest list an entry can produce (checked at AiNode), and
+// only the pages a result touches are ever committed.
+static constexpr size_t kSlotBytes = 20 << 10;
+static constexpr size_t kPoolBytes = (size_t)256 << 20;
+static constexpr unsigned kSlotCache = 16;
+
+static char* g_pool_base;
+static std::atomic<size_t> g_pool_used{0};
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static void* g_pool_free;  // intrusive list, guarded by g_pool_lock
+static pthread_once_t g_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_pool_key;
+
+struct SlotCache {
+  void* slots[kSlotCache];
+  unsigned n;
+  bool registered;
+};
+
+static thread_local SlotCache t_slots;
+
+static void pool_release(void** slots, unsigned n) {
+  if (!n) return;
+  for (unsigned i = 0; i + 1 < n; i++) *(void**)slots[i] = slots[i + 1];
+  pthread_mutex_lock(&g_pool_lock);
+  *(void**)slots[n - 1] = g_pool_free;
+  g_pool_free = slots[0];
+  pthread_mutex_unlock(&g_pool_lock);
+}
+
+static void pool_thread_exit(void* p) {
+  SlotCache* c = (SlotCache*)p;
+  pool_release(c->slots, c->n);
+  c->n = 0;
+  c->registered = false;
+}
+
+static void pool_lock_all() { pthread_mutex_lock(&g_pool_lock); }
+static void pool_unlock_all() { pthread_mutex_unlock(&g_pool_lock); }
+
+static void pool_init() {
+  void* p = mmap(nullptr, kPoolBytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) return;
+  if (pthread_key_create(&g_pool_key, pool_thread_exit) != 0) { munmap(p, kPoolBytes); return; }
+  pthread_atfork(pool_lock_all, pool_unlock_all, pool_unlock_all);
+  g_pool_base = (char*)p;
+}
+
+static inline bool pool_owns(const void* p) {
+  return g_pool_base && (const char*)p >= g_pool_base && (const char*)p < g_pool_base + kPoolBytes;
+}
+
+static void* pool_alloc() {
+  pthread_once(&g_pool_once, pool_init);
+  if (!g_pool_base) return nullptr;
+
+  SlotCache& c = t_slots;
+  if (c.n) return c.slots[--c.n];
+  if (!c.registered) { c.registered = true; pthread_setspecific(g_pool_key, &c); }
+
+  pthread_mutex_lock(&g_pool_lock);
+  while (g_pool_free && c.n < kSlotCache / 2) {
+    c.slots[c.n++] = g_pool_free;
+    g_pool_free = *(void**)g_pool_free;
+  }
+  pthread_mutex_unlock(&g_pool_lock);
+  if (c.n) return c.slots[--c.n];
+
+  size_t off = g_pool_used.fetch_add(kSlotBytes, std::memory_order_relaxed);
+  if (off + kSlotBytes > kPoolBytes) return nullptr;
+  return g_pool_base + off;
+}
+
+static void pool_free(void* p) {
+  void* slot = g_pool_base + ((const char*)p - g_pool_base) / kSlotBytes * kSlotBytes;
+  SlotCache& c = t_slots;
+  if (c.n == kSlotCache) {
+    pool_release(c.slots + kSlotCache / 2, kSlotCache / 2);
+    c.n = kSlotCache / 2;
+  }
+  if (!c.registered) { c.registered = true; pthread_setspecific(g_pool_key, &c); }
+  c.slots[c.n++] = slot;
+}
+
+// Bump allocator over one slot.
+struct SlotWriter {
+  char* p;
+  char* end;
+
+  void* take(size_t n) {
+    n = (n + 7) & ~(size_t)7;
+    if ((size_t)(end - p) < n) return nullptr;
+    void* r = p;
+    p += n;
+    std::memset(r, 0, n);
+    return r;
+  }
+};
+
+union SockAddrIn {
+  sockaddr_in v4;
+  sockaddr_in6 v6;
+};
+
+struct AiNode {
+  addrinfo ai;
+  SockAddrIn sa;
+};
+static_assert(kMaxAddrsPerHost * (sizeof(kSockKinds) / sizeof(kSockKinds[0])) * sizeof(AiNode) + NI_MAXHOST + 8 <= kSlotBytes,
+              "a full addrinfo list must fit one pool slot");
+
+// Which of an entry's addresses a lookup for family and AI_* flags gets;
+// false if none.
+struct AddrSelect {
+  bool want4;
+  bool want6;
+  bool map4;
+};
+
+static bool select_addrs(const LoadedTable& t, const HostEntry& e, int family, int flags, AddrSelect& s) {
+  s.want4 = family == AF_UNSPEC || family == AF_INET;
+  s.want6 = family == AF_UNSPEC || family == AF_INET6;
+  if (flags & AI_ADDRCONFIG) {
+    // Like glibc: with no configured address at all, filter nothing.
+    unsigned seen = addrconfig_seen();
+    if (seen) {
+      s.want4 &= (seen & kSeenV4) != 0;
+      s.want6 &= (seen & kSeenV6) != 0;
+    }
+  }
+
+  bool has4 = false, has6 = false;
+  for (uint32_t i = 0; i < e.addr_count; i++) {
+    int f = t.table.addrs[e.addr_first + i].family;
+    has4 |= f == AF_INET;
+    has6 |= f == AF_INET6;
+  }
+  // v4 addresses as ::ffff:a.b.c.d for AF_INET6 callers: only when there
+  // is no v6 address, or alongside them with AI_ALL.
+  s.map4 = s.want6 && family == AF_INET6 && (flags & AI_V4MAPPED) && (!has6 || (flags & AI_ALL));
+  return ((s.want4 || s.map4) && has4) || (s.want6 && has6);
+}
+
+// Fills sa with addr (as ::ffff:a.b.c.d when mapped) and a port in network
+// order; returns its length.
+static socklen_t fill_sockaddr(SockAddrIn& sa, const HostAddr& addr, bool mapped, int port) {
+  if (mapped) {
+    sa.v6.sin6_family = AF_INET6;
+    sa.v6.sin6_port = (uint16_t)port;
+    sa.v6.sin6_addr.s6_addr[10] = 0xff;
+    sa.v6.sin6_addr.s6_addr[11] = 0xff;
+    std::memcpy(&sa.v6.sin6_addr.s6_addr[12], &addr.v4, sizeof(in_addr));
+    return sizeof(sockaddr_in6);
+  }
+  if (addr.family == AF_INET) {
+    sa.v4.sin_family = AF_INET;
+    sa.v4.sin_port = (uint16_t)port;
+    sa.v4.sin_addr = addr.v4;
+    return sizeof(sockaddr_in);
+  }
+  sa.v6.sin6_family = AF_INET6;
+  sa.v6.sin6_port = (uint16_t)port;
+  sa.v6.sin6_addr = addr.v6;
+  return sizeof(sockaddr_in6);
+}
+
+static int make_addrinfo_list(const char* node, const LoadedTable& t, const HostEntry& e, const char* service,
+                              const struct addrinfo* hints, struct addrinfo** res) {
+  if (!res) return EAI_FAIL;
+  *res = nullptr;
+  // Wildcards match names of any length; none longer than this resolves.
+  if (std::strlen(node) >= NI_MAXHOST) return EAI_NONAME;
+
+  int family = hints ? hints->ai_family : AF_UNSPEC;
+  int socktype = hints ? hints->ai_socktype : 0;
+  int protocol = hints ? hints->ai_protocol : 0;
+  int flags = hints ? hints->ai_flags : 0;
+
+  bool socktype_known = socktype == 0;
+  for (const SockKind& k : kSockKinds) socktype_known |= socktype == k.socktype;
+  if (!socktype_known) return EAI_SOCKTYPE;
+
+  AddrSelect sel;
+  if (!select_addrs(t, e, family, flags, sel)) return EAI_NONAME;
+
+  ServicePorts ports;
+  if (int rc = resolve_service(service, flags, ports)) return rc;
+
+  void* slot = pool_alloc();
+  if (!slot) return EAI_MEMORY;
+  SlotWriter w{(char*)slot, (char*)slot + kSlotBytes};
+
+  char* canon = nullptr;
+  if (flags & AI_CANONNAME) {
+    size_t len = std::strlen(node) + 1;
+    canon = (char*)w.take(len);
+    if (!canon) {
+      pool_free(slot);
+      return EAI_MEMORY;
+    }
+    std::memcpy(canon, node, len);
+  }
+
+  // One node per address and socket type, address-major like glibc.
+  addrinfo* head = nullptr;
+  addrinfo** tail = &head;
+  uint32_t first = pick_first(t, e);
+  for (uint32_t i = 0; i < e.addr_count; i++) {
+    const HostAddr& addr = t.table.addr(e, first, i);
+    bool v4 = addr.family == AF_INET;
+    if (v4 ? !(sel.want4 || sel.map4) : !sel.want6) continue;
+    bool mapped = v4 && !sel.want4;
+
+    for (const SockKind& k : kSockKinds) {
+      if (socktype && socktype != k.socktype) continue;
+      if (protocol && k.protocol && protocol != k.protocol) continue;
+
+      int port = 0;
+      if (ports.given) {
+        port = k.protocol == IPPROTO_TCP ? ports.tcp : k.protocol == IPPROTO_UDP ? ports.udp : -1;
+        if (port < 0) continue;
+      }
+
+      AiNode* n = (AiNode*)w.take(sizeof(AiNode));
+      if (!n) {
+        pool_free(slot);
+        return EAI_MEMORY;
+      }
+
+      n->ai.ai_family = mapped ? AF_INET6 : addr.family;
+      n->ai.ai_socktype = k.socktype;
+      n->ai.ai_protocol = k.protocol ? k.protocol : protocol;
+      n->ai.ai_addr = (sockaddr*)&n->sa;
+      n->ai.ai_addrlen = fill_sockaddr(n->sa, addr, mapped, port);
+
+      *tail = &n->ai;
+      tail = &n->ai.ai_next;
+    }
+  }
+
+  if (!head) {
+    pool_free(slot);
+    return EAI_SERVICE;
+  }
+
+  head->ai_canonname = canon;
+  *res = head;
+  return 0;
 }
 
-static std::string trim(const std::string& s) {
-  size_t a = 0, b = s.size();
-  while (a < b && std::isspace((unsigned char)s[a])) a++;
-  while (b > a && std::isspace((unsigned char)s[b - 1])) b--;
-  return s.substr(a, b - a);
+// Copies an upstream list into one slot, nodes first so the head sits at
+// the slot base. Returns nullptr if it does not fit.
+static addrinfo* copy_to_slot(const addrinfo* src, SlotWriter& w) {
+  addrinfo* head = nullptr;
+  addrinfo** tail = &head;
+  for (const addrinfo* s = src; s; s = s->ai_next) {
+    addrinfo* n = (addrinfo*)w.take(sizeof(addrinfo));
+    if (!n) return nullptr;
+    *n = *s;
+    n->ai_next = nullptr;
+    if (s->ai_addr) {
+      if (!(n->ai_addr = (sockaddr*)w.take(s->ai_addrlen))) return nullptr;
+      std::memcpy(n->ai_addr, s->ai_addr, s->ai_addrlen);
+    }
+    *tail = n;
+    tail = &n->ai_next;
+  }
+  for (addrinfo* n = head; n; n = n->ai_next) {
+    if (!n->ai_canonname) continue;
+    size_t len = std::strlen(n->ai_canonname) + 1;
+    char* c = (char*)w.take(len);
+    if (!c) return nullptr;
+    std::memcpy(c, n->ai_canonname, len);
+    n->ai_canonname = c;
+  }
+  return head;
 }
 
-static void parse_map_env() {
-  const char* env = std::getenv("OVERRIDEHOSTS");
-  if (!env || !*env) {
-    g_inited.store(true);
-    return;
+// Moves a list copied byte for byte from one slot into another.
+static void relocate(addrinfo* head, uintptr_t from, uintptr_t to) {
+  auto fix = [&](auto*& p) { if (p) p = (std::remove_reference_t<decltype(p)>)((uintptr_t)p - from + to); };
+  for (addrinfo* n = head; n; n = n->ai_next) {
+    fix(n->ai_addr);
+    fix(n->ai_canonname);
+    fix(n->ai_next);
+  }
+}
+
+// --- upstream result cache (OVERRIDEHOSTS_CACHE_TTL) ---
+// Positive and negative real getaddrinfo() results for names we do not
+// override, keyed by node, service and the hints fields that change the
+// answer. Shards are 4-way set associative; a hit is one copy of the
+// stored slot image into a fresh slot. Results that do not fit a slot are
+// not cached.
+//
+// Reads take no lock. Each way is a seqlock: writers (serialized by the
+// shard mutex) make seq odd, rewrite the way and make it even again, and
+// a reader keeps what it copied only if seq was even and unchanged around
+// the copy. The key lives in the way and the answer in a pool slot the
+// way owns for good and rewrites in place, so a reader racing a writer
+// only ever sees stale bytes, never freed memory. Everything a reader
+// touches is a relaxed atomic, which keeps the race defined.
+
+static constexpr unsigned kCacheShards = 16;
+static constexpr unsigned kCacheSets = 16;
+static constexpr unsigned kCacheWays = 4;
+static constexpr size_t kCacheMaxKey = 512;
+static constexpr size_t kCacheKeyWords = kCacheMaxKey / 8;
+static_assert(kSlotBytes % 8 == 0, "slot images are copied in words");
+
+typedef std::atomic<uint64_t> CacheWord;
+
+struct CacheEntry {
+  std::atomic<uint32_t> seq;  // odd while being written
+  std::atomic<uint32_t> key_len;
+  std::atomic<uint32_t> blob_len;
+  std::atomic<int> rc;
+  std::atomic<uint64_t> hash;
+  std::atomic<uint64_t> expires;  // monotonic ns, 0 = empty
+  std::atomic<uintptr_t> base;    // where the stored image was built
+  std::atomic<CacheWord*> blob;   // pool slot, set once on first use
+  CacheWord key[kCacheKeyWords];  // zero padded
+};
+
+struct alignas(64) CacheShard {
+  pthread_mutex_t lock;  // writers only
+  CacheEntry ways[kCacheSets][kCacheWays];
+};
+
+static uint64_t g_cache_ttl_ns;
+static uint64_t g_cache_neg_ttl_ns;
+static CacheShard g_cache[kCacheShards];
+
+static void cache_lock_all() { for (CacheShard& s : g_cache) pthread_mutex_lock(&s.lock); }
+static void cache_unlock_all() { for (CacheShard& s : g_cache) pthread_mutex_unlock(&s.lock); }
+
+static uint64_t parse_seconds(const char* s) {
+  if (!s || !*s) return 0;
+  char* end;
+  double v = std::strtod(s, &end);
+  return (*end || v <= 0) ? 0 : (uint64_t)(v * 1e9);
+}
+
+static void cache_init_env() {
+  g_cache_ttl_ns = parse_seconds(std::getenv("OVERRIDEHOSTS_CACHE_TTL"));
+  if (!g_cache_ttl_ns) return;
+  const char* neg = std::getenv("OVERRIDEHOSTS_CACHE_NEG_TTL");
+  g_cache_neg_ttl_ns = neg ? parse_seconds(neg) : g_cache_ttl_ns;
+  for (CacheShard& s : g_cache) pthread_mutex_init(&s.lock, nullptr);
+  pthread_atfork(cache_lock_all, cache_unlock_all, cache_unlock_all);
+}
+
+static bool cacheable_rc(int rc) {
+#ifdef EAI_NODATA
+  if (rc == EAI_NODATA) return true;
+#endif
+  return rc == 0 || rc == EAI_NONAME;
+}
+
+// key = family, socktype, protocol, flags, node, NUL, service.
+static size_t cache_key(char* key, const char* node, const char* service, const struct addrinfo* hints) {
+  int f[4] = {hints ? hints->ai_family : 0, hints ? hints->ai_socktype : 0,
+              hints ? hints->ai_protocol : 0, hints ? hints->ai_flags : 0};
+  size_t nl = std::strlen(node), sl = service ? std::strlen(service) : 0;
+  size_t len = sizeof(f) + nl + 1 + sl;
+  if (len > kCacheMaxKey) return 0;
+  std::memcpy(key, f, sizeof(f));
+  std::memcpy(key + sizeof(f), node, nl + 1);
+  if (sl) std::memcpy(key + sizeof(f) + nl + 1, service, sl);
+  return len;
+}
+
+static uint64_t hash_bytes(const char* p, size_t n) {
+  uint64_t h = 1469598103934665603ull;
+  for (size_t i = 0; i < n; i++) { h ^= (unsigned char)p[i]; h *= 1099511628211ull; }
+  return h;
+}
+
+// Word i of p[0, len), zero padded past the end.
+static inline uint64_t cache_word(const char* p, size_t len, size_t i) {
+  uint64_t w = 0;
+  size_t off = i * 8;
+  std::memcpy(&w, p + off, len - off < 8 ? len - off : 8);
+  return w;
+}
+
+static bool cache_key_equal(const CacheEntry& e, const char* key, size_t len) {
+  for (size_t i = 0; i * 8 < len; i++)
+    if (e.key[i].load(std::memory_order_relaxed) != cache_word(key, len, i)) return false;
+  return true;
+}
+
+// One attempt at way e. False if it does not hold key; *torn if a writer
+// got in the way and the caller should look again.
+static bool cache_read_way(CacheEntry& e, const char* key, size_t len, uint64_t hash, uint64_t now,
+                           int* rc, struct addrinfo** res, bool* torn) {
+  uint32_t seq = e.seq.load(std::memory_order_acquire);
+  if (seq & 1) {
+    *torn = true;
+    return false;
   }
+  if (e.hash.load(std::memory_order_relaxed) != hash || e.expires.load(std::memory_order_relaxed) <= now ||
+      e.key_len.load(std::memory_order_relaxed) != len || !cache_key_equal(e, key, len))
+    return false;
+
+  int r = e.rc.load(std::memory_order_relaxed);
+  void* slot = nullptr;
+  uintptr_t base = 0;
+  if (r == 0) {
+    uint32_t n = e.blob_len.load(std::memory_order_relaxed);
+    base = e.base.load(std::memory_order_relaxed);
+    CacheWord* blob = e.blob.load(std::memory_order_relaxed);
+    if (!blob || n > kSlotBytes || !(slot = pool_alloc())) return false;
+    for (size_t i = 0; i * 8 < n; i++) {
+      uint64_t w = blob[i].load(std::memory_order_relaxed);
+      std::memcpy((char*)slot + i * 8, &w, 8);
+    }
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (e.seq.load(std::memory_order_relaxed) != seq) {
+    if (slot) pool_free(slot);
+    *torn = true;
+    return false;
+  }
+  if (slot) {
+    *res = (addrinfo*)slot;
+    relocate(*res, base, (uintptr_t)slot);
+  }
+  *rc = r;
+  return true;
+}
+
+// Returns true on a hit, with *rc and (for rc == 0) *res filled in. A way
+// that keeps changing under us counts as a miss.
+static bool cache_get(const char* key, size_t len, uint64_t hash, int* rc, struct addrinfo** res) {
+  CacheShard& s = g_cache[hash % kCacheShards];
+  CacheEntry* set = s.ways[(hash / kCacheShards) % kCacheSets];
+  uint64_t now = now_ns();
+  for (unsigned w = 0; w < kCacheWays; w++) {
+    for (unsigned tries = 0; tries < 4; tries++) {
+      bool torn = false;
+      if (cache_read_way(set[w], key, len, hash, now, rc, res, &torn)) return true;
+      if (!torn) break;
+    }
+  }
+  return false;
+}
+
+static void cache_put(const char* key, size_t len, uint64_t hash, int rc, const void* slot, size_t used) {
+  uint64_t ttl = rc == 0 ? g_cache_ttl_ns : g_cache_neg_ttl_ns;
+  if (!ttl || used > kSlotBytes) return;
+
+  CacheShard& s = g_cache[hash % kCacheShards];
+  CacheEntry* set = s.ways[(hash / kCacheShards) % kCacheSets];
+  uint64_t now = now_ns();
+
+  pthread_mutex_lock(&s.lock);
+  // Same key, else an expired way, else the one expiring soonest.
+  CacheEntry* victim = &set[0];
+  for (unsigned w = 0; w < kCacheWays; w++) {
+    CacheEntry& e = set[w];
+    uint64_t exp = e.expires.load(std::memory_order_relaxed);
+    if (e.hash.load(std::memory_order_relaxed) == hash && e.key_len.load(std::memory_order_relaxed) == len &&
+        cache_key_equal(e, key, len)) {
+      victim = &e;
+      break;
+    }
+    uint64_t best = victim->expires.load(std::memory_order_relaxed);
+    if (exp <= now) victim = &e;
+    else if (best > now && exp < best) victim = &e;
+  }
+  CacheEntry& e = *victim;
+  CacheWord* blob = e.blob.load(std::memory_order_relaxed);
+  if (used && !blob) {
+    if (!(blob = (CacheWord*)pool_alloc())) {
+      pthread_mutex_unlock(&s.lock);
+      return;
+    }
+    e.blob.store(blob, std::memory_order_relaxed);
+  }
+
+  uint32_t seq = e.seq.load(std::memory_order_relaxed);
+  e.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  e.hash.store(hash, std::memory_order_relaxed);
+  e.expires.store(now + ttl, std::memory_order_relaxed);
+  e.key_len.store((uint32_t)len, std::memory_order_relaxed);
+  e.blob_len.store((uint32_t)used, std::memory_order_relaxed);
+  e.rc.store(rc, std::memory_order_relaxed);
+  e.base.store((uintptr_t)slot, std::memory_order_relaxed);
+  for (size_t i = 0; i * 8 < len; i++) e.key[i].store(cache_word(key, len, i), std::memory_order_relaxed);
+  for (size_t i = 0; i * 8 < used; i++)
+    blob[i].store(cache_word((const char*)slot, used, i), std::memory_order_relaxed);
+  e.seq.store(seq + 2, std::memory_order_release);
+  pthread_mutex_unlock(&s.lock);
+}
+
+// --- single-flight (OVERRIDEHOSTS_COALESCE) ---
+// Concurrent upstream lookups with the same key share one real call: the
+// first caller becomes the leader, later ones sleep on its flight and get
+// their own copy of the leader's slot image. Flights are refcounted since
+// waiters may still be copying after the leader returns.
+struct Flight {
+  Flight* next;
+  uint64_t hash;
+  const char* key;  // leader's stack, valid while linked
+  uint32_t key_len;
+  uint32_t refs;
+  bool done;
+  int rc;
+  char* blob;       // nullptr if the result did not fit a slot
+  uint32_t blob_len;
+  uintptr_t base;
+  pthread_cond_t cv;
+};
+
+struct alignas(64) FlightShard {
+  pthread_mutex_t lock;
+  Flight* head;
+};
+
+static bool g_coalesce;
+static FlightShard g_flights[kCacheShards];
+
+static void flights_lock_all() { for (FlightShard& s : g_flights) pthread_mutex_lock(&s.lock); }
+static void flights_unlock_all() { for (FlightShard& s : g_flights) pthread_mutex_unlock(&s.lock); }
+
+// A child inherits the flights but not their leaders, so nothing would
+// ever finish them; start over and leak the orphans.
+static void flights_atfork_child() {
+  for (FlightShard& s : g_flights) {
+    pthread_mutex_init(&s.lock, nullptr);
+    s.head = nullptr;
+  }
+}
+
+static void coalesce_init_env() {
+  const char* v = std::getenv("OVERRIDEHOSTS_COALESCE");
+  g_coalesce = v && *v && std::strcmp(v, "0") != 0;
+  if (!g_coalesce) return;
+  for (FlightShard& s : g_flights) pthread_mutex_init(&s.lock, nullptr);
+  pthread_atfork(flights_lock_all, flights_unlock_all, flights_atfork_child);
+}
+
+static void flight_unref(FlightShard& s, Flight* f) {
+  pthread_mutex_lock(&s.lock);
+  bool last = --f->refs == 0;
+  pthread_mutex_unlock(&s.lock);
+  if (!last) return;
+  pthread_cond_destroy(&f->cv);
+  free(f->blob);
+  free(f);
+}
+
+// Returns the flight to finish if we lead, or nullptr once a leader's
+// result has been copied into *rc / *res. *joined is false if we could
+// not join or lead (allocation failure) and should just call upstream.
+static Flight* flight_begin(const char* key, size_t len, uint64_t hash,
+                            int* rc, struct addrinfo** res, bool* joined) {
+  FlightShard& s = g_flights[hash % kCacheShards];
+  *joined = true;
 
-  std::string all(env);
-  size_t i = 0;
-  while (i < all.size()) {
-    size_t j = all.find(',', i);
-    if (j == std::string::npos) j = all.size();
-    std::string item = trim(all.substr(i, j - i));
-    i = j + 1;
-    if (item.empty()) continue;
+  pthread_mutex_lock(&s.lock);
+  Flight* f = s.head;
+  while (f && !(f->hash == hash && f->key_len == len && std::memcmp(f->key, key, len) == 0))
+    f = f->next;
 
-    // Split on first ':'
-    size_t c = item.find(':');
-    if (c == std::string::npos || c == 0 || c + 1 >= item.size()) continue;
+  if (!f) {
+    f = (Flight*)calloc(1, sizeof(Flight));
+    if (!f) {
+      pthread_mutex_unlock(&s.lock);
+      *joined = false;
+      return nullptr;
+    }
+    f->hash = hash;
+    f->key = key;
+    f->key_len = (uint32_t)len;
+    f->refs = 1;
+    pthread_cond_init(&f->cv, nullptr);
+    f->next = s.head;
+    s.head = f;
+    pthread_mutex_unlock(&s.lock);
+    return f;
+  }
 
-    std::string host = to_lower(trim(item.substr(0, c)));
-    std::string ip   = trim(item.substr(c + 1));
+  f->refs++;
+  while (!f->done) pthread_cond_wait(&f->cv, &s.lock);
+  pthread_mutex_unlock(&s.lock);
 
-    // If IPv6 is in [..], strip brackets.
-    if (!ip.empty() && ip.front() == '[' && ip.back() == ']' && ip.size() >= 3) {
-      ip = ip.substr(1, ip.size() - 2);
+  // The blob is immutable once done is set.
+  *rc = f->rc;
+  if (f->rc == 0) {
+    void* slot = f->blob ? pool_alloc() : nullptr;
+    if (slot) {
+      std::memcpy(slot, f->blob, f->blob_len);
+      *res = (addrinfo*)slot;
+      relocate(*res, f->base, (uintptr_t)slot);
+    } else {
+      *joined = false;
     }
+  }
+  flight_unref(s, f);
+  return nullptr;
+}
 
-    if (!host.empty() && !ip.empty()) g_map[host] = ip;
+static void flight_finish(Flight* f, int rc, const void* slot, size_t used) {
+  FlightShard& s = g_flights[f->hash % kCacheShards];
+  char* blob = nullptr;
+  if (rc == 0 && slot && (blob = (char*)malloc(used))) std::memcpy(blob, slot, used);
+
+  pthread_mutex_lock(&s.lock);
+  for (Flight** pp = &s.head; *pp; pp = &(*pp)->next) {
+    if (*pp == f) {
+      *pp = f->next;
+      break;
+    }
   }
+  f->key = nullptr;
+  f->rc = rc;
+  f->blob = blob;
+  f->blob_len = (uint32_t)used;
+  f->base = (uintptr_t)slot;
+  f->done = true;
+  pthread_cond_broadcast(&f->cv);
+  pthread_mutex_unlock(&s.lock);
+  flight_unref(s, f);
+}
+
+static inline bool upstream_probed() {
+#ifdef OVERRIDEHOSTS_USDT
+  return __builtin_expect(*(volatile unsigned short*)&overridehosts_upstream_semaphore != 0, 0);
+#else
+  return false;
+#endif
+}
 
-  g_inited.store(true);
+static int timed_getaddrinfo(const char* node, const char* service,
+                             const struct addrinfo* hints, struct addrinfo** res) {
+  if (!g_stats && !g_trace && !upstream_probed()) return g_real.getaddrinfo(node, service, hints, res);
+  uint64_t start = clock_ns(CLOCK_MONOTONIC);
+  int rc = g_real.getaddrinfo(node, service, hints, res);
+  uint64_t duration = clock_ns(CLOCK_MONOTONIC) - start;
+  stat_upstream(duration, rc != 0);
+  if (node) trace_upstream(node, rc, duration);
+  return rc;
 }
 
-static void ensure_inited() {
-  std::call_once(g_init_once, []() { parse_map_env(); });
+// Cache lookup, then single-flight, then the real resolver. Successful
+// answers are moved into a pool slot so both layers can hand out copies.
+static int upstream_getaddrinfo(const char* node, const char* service,
+                                const struct addrinfo* hints, struct addrinfo** res) {
+  char key[kCacheMaxKey];
+  size_t len = cache_key(key, node, service, hints);
+  if (!len) return timed_getaddrinfo(node, service, hints, res);
+
+  uint64_t hash = hash_bytes(key, len);
+  int rc;
+  if (g_cache_ttl_ns && cache_get(key, len, hash, &rc, res)) {
+    stat_add(kStatCacheHits);
+    return rc;
+  }
+
+  Flight* flight = nullptr;
+  if (g_coalesce) {
+    bool joined;
+    flight = flight_begin(key, len, hash, &rc, res, &joined);
+    if (!flight && joined) {
+      stat_add(kStatCoalesced);
+      return rc;
+    }
+  }
+
+  rc = timed_getaddrinfo(node, service, hints, res);
+  void* slot = nullptr;
+  size_t used = 0;
+  if (rc == 0 && (slot = pool_alloc())) {
+    // Hand the caller our copy so the cached image and the result agree.
+    SlotWriter w{(char*)slot, (char*)slot + kSlotBytes};
+    if (addrinfo* copy = copy_to_slot(*res, w)) {
+      g_real.freeaddrinfo(*res);
+      *res = copy;
+      used = (size_t)(w.p - (char*)slot);
+    } else {
+      pool_free(slot);
+      slot = nullptr;
+    }
+  }
+
+  if (g_cache_ttl_ns && cacheable_rc(rc) && (rc != 0 || slot))
+    cache_put(key, len, hash, rc, slot, used);
+  if (flight) flight_finish(flight, rc, slot, used);
+  return rc;
 }
 
-static bool lookup_ip_for(const char* node, std::string& out_ip) {
-  if (!node || !*node) return false;
+// --- getaddrinfo override ---
+OVERRIDEHOSTS_EXPORT int getaddrinfo(const char* node, const char* service,
+                           const struct addrinfo* hints, struct addrinfo** res) {
   ensure_inited();
-  auto it = g_map.find(to_lower(std::string(node)));
-  if (it == g_map.end()) return false;
-  out_ip = it->second;
-  return true;
+  {
+    TableRef ref;
+    if (const HostEntry* e = lookup_ip_for(node, ref))
+      return make_addrinfo_list(node, *ref.t, *e, service, hints, res);
+  }
+
+  if (!g_real.getaddrinfo) return EAI_FAIL;
+  if ((g_cache_ttl_ns || g_coalesce) && node && res && g_real.freeaddrinfo)
+    return upstream_getaddrinfo(node, service, hints, res);
+  return timed_getaddrinfo(node, service, hints, res);
 }
 
-static int make_addrinfo_list(const std::string& ip, const struct addrinfo* hints, struct addrinfo** res) {
-  if (!res) return EAI_FAIL;
-  *res = nullptr;
+OVERRIDEHOSTS_EXPORT void freeaddrinfo(struct addrinfo* ai) {
+  if (!ai) return;
+  if (pool_owns(ai)) {
+    pool_free(ai);
+    return;
+  }
+  // A libc list handed out before our constructor ran.
+  if (!g_real.freeaddrinfo) ensure_inited();
+  if (g_real.freeaddrinfo) g_real.freeaddrinfo(ai);
+}
 
-  int family = hints ? hints->ai_family : AF_UNSPEC;
-  int socktype = hints ? hints->ai_socktype : 0;
-  int protocol = hints ? hints->ai_protocol : 0;
+#ifdef __GLIBC__
+// --- getaddrinfo_a override (glibc) ---
+// Overridden requests are answered inline and marked done. The rest go to
+// a small pool of our own workers, which resolve them through getaddrinfo()
+// above, so misses share its answer cache, coalescing and tracing, and no
+// request waits behind glibc's single resolver list. Since those requests
+// are not glibc's, gai_suspend() and gai_cancel() are ours too; gai_error()
+// only reads __return and needs no override. Workers start on demand, up
+// to kGaiMaxWorkers, and exit after kGaiIdleSec without work.
+
+static constexpr unsigned kGaiMaxWorkers = 8;
+static constexpr long kGaiIdleSec = 10;
+
+struct NotifyArgs {
+  void (*fn)(union sigval);
+  union sigval value;
+};
+
+static void* notify_main(void* p) {
+  NotifyArgs args = *(NotifyArgs*)p;
+  free(p);
+  args.fn(args.value);
+  return nullptr;
+}
+
+static int notify_done(struct sigevent* sevp) {
+  if (!sevp) return 0;
+  if (sevp->sigev_notify == SIGEV_SIGNAL) {
+    sigqueue(getpid(), sevp->sigev_signo, sevp->sigev_value);
+  } else if (sevp->sigev_notify == SIGEV_THREAD) {
+    NotifyArgs* args = (NotifyArgs*)malloc(sizeof(NotifyArgs));
+    if (!args) return EAI_MEMORY;
+    *args = NotifyArgs{sevp->sigev_notify_function, sevp->sigev_value};
+
+    pthread_attr_t attr;
+    if (sevp->sigev_notify_attributes) attr = *sevp->sigev_notify_attributes;
+    else pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t tid;
+    int rc = pthread_create(&tid, &attr, notify_main, args);
+    if (!sevp->sigev_notify_attributes) pthread_attr_destroy(&attr);
+    if (rc != 0) {
+      free(args);
+      return EAI_AGAIN;
+    }
+  }
+  return 0;
+}
+
+struct GaiBatch;
+
+struct GaiJob {
+  gaicb* req;
+  GaiBatch* batch;
+  GaiJob* next;
+};
+
+// One getaddrinfo_a() call's queued requests, in a single allocation with
+// its jobs after it. Freed by whoever finishes it: the GAI_WAIT caller,
+// or for GAI_NOWAIT whoever completes (or cancels) the last request.
+struct GaiBatch {
+  int mode;
+  unsigned remaining;  // guarded by g_gai_lock
+  struct sigevent sev;
+
+  GaiJob* jobs() { return (GaiJob*)(this + 1); }
+};
+
+static pthread_mutex_t g_gai_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_gai_work;  // the queue got a job
+static pthread_cond_t g_gai_done;  // some request finished
+static pthread_once_t g_gai_once = PTHREAD_ONCE_INIT;
+static GaiJob* g_gai_head;  // FIFO, guarded by g_gai_lock
+static GaiJob** g_gai_tail = &g_gai_head;
+static unsigned g_gai_workers;
+static unsigned g_gai_idle;
+
+static void gai_init_conds() {
+  pthread_condattr_t ca;
+  pthread_condattr_init(&ca);
+  pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+  pthread_cond_init(&g_gai_work, &ca);
+  pthread_cond_init(&g_gai_done, &ca);
+  pthread_condattr_destroy(&ca);
+}
+
+// Workers do not survive fork(); queued requests stay queued for the
+// child's first getaddrinfo_a() to pick up.
+static void gai_lock_all() { pthread_mutex_lock(&g_gai_lock); }
+static void gai_unlock_all() { pthread_mutex_unlock(&g_gai_lock); }
+static void gai_atfork_child() {
+  pthread_mutex_init(&g_gai_lock, nullptr);
+  gai_init_conds();
+  g_gai_workers = 0;
+  g_gai_idle = 0;
+}
+
+static void gai_init() {
+  gai_init_conds();
+  pthread_atfork(gai_lock_all, gai_unlock_all, gai_atfork_child);
+}
+
+static timespec deadline_after(long sec, long nsec) {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_sec += sec + (ts.tv_nsec + nsec) / 1000000000;
+  ts.tv_nsec = (ts.tv_nsec + nsec) % 1000000000;
+  return ts;
+}
+
+// Records a request's outcome. Called with g_gai_lock held; returns the
+// batch if that was its last request and the caller must notify and free
+// it once the lock is dropped.
+static GaiBatch* gai_finish(GaiJob* j, addrinfo* res, int rc) {
+  j->req->ar_result = res;
+  __atomic_store_n(&j->req->__return, rc, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&g_gai_done);
+  GaiBatch* b = j->batch;
+  return --b->remaining == 0 && b->mode == GAI_NOWAIT ? b : nullptr;
+}
+
+static void gai_release(GaiBatch* b) {
+  if (!b) return;
+  notify_done(&b->sev);
+  free(b);
+}
+
+static void* gai_worker(void*) {
+  pthread_mutex_lock(&g_gai_lock);
+  for (;;) {
+    while (!g_gai_head) {
+      timespec until = deadline_after(kGaiIdleSec, 0);
+      g_gai_idle++;
+      int rc = pthread_cond_timedwait(&g_gai_work, &g_gai_lock, &until);
+      g_gai_idle--;
+      if (rc == ETIMEDOUT && !g_gai_head) {
+        g_gai_workers--;
+        pthread_mutex_unlock(&g_gai_lock);
+        return nullptr;
+      }
+    }
+    GaiJob* j = g_gai_head;
+    g_gai_head = j->next;
+    if (!g_gai_head) g_gai_tail = &g_gai_head;
+    pthread_mutex_unlock(&g_gai_lock);
+
+    addrinfo* res = nullptr;
+    int rc = getaddrinfo(j->req->ar_name, j->req->ar_service, j->req->ar_request, &res);
+
+    pthread_mutex_lock(&g_gai_lock);
+    if (GaiBatch* b = gai_finish(j, res, rc)) {
+      pthread_mutex_unlock(&g_gai_lock);
+      gai_release(b);
+      pthread_mutex_lock(&g_gai_lock);
+    }
+  }
+}
+
+static bool gai_start_worker() {
+  // Keep the application's signals off this thread.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t tid;
+  int rc = pthread_create(&tid, &attr, gai_worker, nullptr);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  return rc == 0;
+}
 
-  // Determine if ip is v4 or v6
-  in_addr  a4{};
-  in6_addr a6{};
-  bool is4 = inet_pton(AF_INET, ip.c_str(), &a4) == 1;
-  bool is6 = inet_pton(AF_INET6, ip.c_str(), &a6) == 1;
-  if (!is4 && !is6) return EAI_NONAME;
-
-  // Respect family hint if set
-  if (family == AF_INET && !is4) return EAI_NONAME;
-  if (family == AF_INET6 && !is6) return EAI_NONAME;
-
-  // If AF_UNSPEC and ip parses as v4, return v4; if v6, return v6.
-  int out_family = is4 ? AF_INET : AF_INET6;
-
-  // Create one addrinfo node
-  addrinfo* ai = (addrinfo*)calloc(1, sizeof(addrinfo));
-  if (!ai) return EAI_MEMORY;
-
-  ai->ai_family = out_family;
-  ai->ai_socktype = socktype;
-  ai->ai_protocol = protocol;
-
-  if (out_family == AF_INET) {
-    sockaddr_in* sa = (sockaddr_in*)calloc(1, sizeof(sockaddr_in));
-    if (!sa) { free(ai); return EAI_MEMORY; }
-    sa->sin_family = AF_INET;
-    sa->sin_addr = a4;
-    ai->ai_addr = (sockaddr*)sa;
-    ai->ai_addrlen = sizeof(sockaddr_in);
+static int gai_submit(int mode, gaicb** reqs, unsigned n, struct sigevent* sevp) {
+  pthread_once(&g_gai_once, gai_init);
+  GaiBatch* b = (GaiBatch*)malloc(sizeof(GaiBatch) + sizeof(GaiJob) * n);
+  if (!b) return EAI_MEMORY;
+  b->mode = mode;
+  b->remaining = n;
+  if (sevp) {
+    b->sev = *sevp;
   } else {
-    sockaddr_in6* sa = (sockaddr_in6*)calloc(1, sizeof(sockaddr_in6));
-    if (!sa) { free(ai); return EAI_MEMORY; }
-    sa->sin6_family = AF_INET6;
-    sa->sin6_addr = a6;
-    ai->ai_addr = (sockaddr*)sa;
-    ai->ai_addrlen = sizeof(sockaddr_in6);
+    std::memset(&b->sev, 0, sizeof(b->sev));
+    b->sev.sigev_notify = SIGEV_NONE;
   }
 
-  ai->ai_next = nullptr;
-  *res = ai;
+  pthread_mutex_lock(&g_gai_lock);
+  GaiJob** old_tail = g_gai_tail;
+  for (unsigned i = 0; i < n; i++) {
+    GaiJob* j = &b->jobs()[i];
+    *j = GaiJob{reqs[i], b, nullptr};
+    reqs[i]->ar_result = nullptr;
+    __atomic_store_n(&reqs[i]->__return, EAI_INPROGRESS, __ATOMIC_RELAXED);
+    *g_gai_tail = j;
+    g_gai_tail = &j->next;
+  }
+  // Enough workers for the batch, as far as the cap allows.
+  for (unsigned started = 0; g_gai_idle + started < n && g_gai_workers < kGaiMaxWorkers; started++) {
+    if (!gai_start_worker()) break;
+    g_gai_workers++;
+  }
+  if (!g_gai_workers) {
+    *old_tail = nullptr;
+    g_gai_tail = old_tail;
+    pthread_mutex_unlock(&g_gai_lock);
+    for (unsigned i = 0; i < n; i++) reqs[i]->__return = EAI_AGAIN;
+    free(b);
+    return EAI_AGAIN;
+  }
+  pthread_cond_broadcast(&g_gai_work);
+
+  if (mode == GAI_WAIT) {
+    while (b->remaining) pthread_cond_wait(&g_gai_done, &g_gai_lock);
+    pthread_mutex_unlock(&g_gai_lock);
+    free(b);
+    return 0;
+  }
+  pthread_mutex_unlock(&g_gai_lock);
   return 0;
 }
 
-// --- getaddrinfo override ---
-using real_getaddrinfo_t = int(*)(const char*, const char*, const struct addrinfo*, struct addrinfo**);
+OVERRIDEHOSTS_EXPORT int getaddrinfo_a(int mode, struct gaicb* list[], int nitems, struct sigevent* sevp) {
+  ensure_inited();
+  if (mode != GAI_WAIT && mode != GAI_NOWAIT) {
+    errno = EINVAL;
+    return EAI_SYSTEM;
+  }
+  std::vector<gaicb*> rest;
+  {
+    TableRef ref;
+    for (int i = 0; i < nitems; i++) {
+      gaicb* req = list[i];
+      if (!req) continue;
+      const HostEntry* e = lookup_ip_for(req->ar_name, ref);
+      if (!e) {
+        rest.push_back(req);
+        continue;
+      }
+      req->ar_result = nullptr;
+      req->__return = make_addrinfo_list(req->ar_name, *ref.t, *e, req->ar_service,
+                                         req->ar_request, &req->ar_result);
+    }
+  }
 
-extern "C" int getaddrinfo(const char* node, const char* service,
-                           const struct addrinfo* hints, struct addrinfo** res) {
-  static real_getaddrinfo_t real_getaddrinfo =
-      (real_getaddrinfo_t)dlsym(RTLD_NEXT, "getaddrinfo");
+  if (rest.empty()) return mode == GAI_NOWAIT ? notify_done(sevp) : 0;
+  return gai_submit(mode, rest.data(), (unsigned)rest.size(), sevp);
+}
 
-  std::string ip;
-  if (lookup_ip_for(node, ip)) {
-    // We ignore "service" here; callers typically call getaddrinfo with service and then set port later.
-    // If needed, you can parse service to port and set it in sockaddr.
-    return make_addrinfo_list(ip, hints, res);
+OVERRIDEHOSTS_EXPORT int gai_suspend(const struct gaicb* const list[], int nitems, const struct timespec* timeout) {
+  pthread_once(&g_gai_once, gai_init);
+  timespec until{};
+  if (timeout) until = deadline_after(timeout->tv_sec, timeout->tv_nsec);
+
+  int rc;
+  pthread_mutex_lock(&g_gai_lock);
+  for (;;) {
+    bool any = false, done = false;
+    for (int i = 0; i < nitems; i++) {
+      if (!list[i]) continue;
+      any = true;
+      done |= list[i]->__return != EAI_INPROGRESS;
+    }
+    if (!any) {
+      rc = EAI_ALLDONE;
+      break;
+    }
+    if (done) {
+      rc = 0;
+      break;
+    }
+    if (!timeout) {
+      pthread_cond_wait(&g_gai_done, &g_gai_lock);
+    } else if (pthread_cond_timedwait(&g_gai_done, &g_gai_lock, &until) == ETIMEDOUT) {
+      rc = EAI_AGAIN;
+      break;
+    }
   }
+  pthread_mutex_unlock(&g_gai_lock);
+  return rc;
+}
 
-  return real_getaddrinfo ? real_getaddrinfo(node, service, hints, res) : EAI_FAIL;
+// Only a request still queued can be cancelled; it then counts as finished
+// for its batch, so a GAI_NOWAIT notification still arrives.
+OVERRIDEHOSTS_EXPORT int gai_cancel(struct gaicb* req) {
+  pthread_once(&g_gai_once, gai_init);
+  pthread_mutex_lock(&g_gai_lock);
+  int rc = req->__return == EAI_INPROGRESS ? EAI_NOTCANCELED : EAI_ALLDONE;
+  GaiBatch* release = nullptr;
+  for (GaiJob** p = &g_gai_head; *p; p = &(*p)->next) {
+    GaiJob* j = *p;
+    if (j->req != req) continue;
+    *p = j->next;
+    if (g_gai_tail == &j->next) g_gai_tail = p;
+    release = gai_finish(j, nullptr, EAI_CANCELED);
+    rc = EAI_CANCELED;
+    break;
+  }
+  pthread_mutex_unlock(&g_gai_lock);
+  gai_release(release);
+  return rc;
 }
+#endif
 
 // --- gethostbyname override (legacy) ---
-using real_gethostbyname_t = struct hostent*(*)(const char*);
-using real_gethostbyname2_t = struct hostent*(*)(const char*, int);
 
-static thread_local hostent g_he{};
-static thread_local std::vector<unsigned char> g_addr_storage;
-static thread_local std::vector<char*> g_addr_list;
-static thread_local std::string g_name;
-static thread_local std::string g_ip_str;
+// Storage behind the non-reentrant calls' results. Trivially destructible
+// and fixed size, so threads pay no TLS destructor registration and hits
+// never allocate. Room for a full entry of v6 addresses and an NI_MAXHOST
+// name, plus alignment slack.
+static constexpr size_t kHostentBuf =
+    sizeof(char*) * (kMaxAddrsPerHost + 2) + sizeof(in6_addr) * kMaxAddrsPerHost + NI_MAXHOST + alignof(char*);
+
+struct HostentTls {
+  hostent he;
+  char buf[kHostentBuf];
+};
+static_assert(std::is_trivially_destructible<HostentTls>::value, "HostentTls must not need a TLS destructor");
+
+static thread_local HostentTls g_hostent;
+
+// Writes a hostent into a caller-supplied buffer the way the _r functions
+// do: pointer arrays first, then addresses, then the name. 0 or ERANGE.
+static int write_hostent(hostent* ret, char* buf, size_t buflen, std::string_view name,
+                         int af, const unsigned char (*addrs)[16], uint32_t n) {
+  size_t alen = af == AF_INET ? sizeof(in_addr) : sizeof(in6_addr);
+  size_t pad = (size_t)(-(uintptr_t)buf & (alignof(char*) - 1));
+  size_t need = pad + sizeof(char*) * (n + 2) + alen * n + name.size() + 1;
+  if (!buf || need > buflen) return ERANGE;
+
+  char** list = (char**)(buf + pad);
+  char** aliases = list + n + 1;
+  char* p = (char*)(aliases + 1);
+  for (uint32_t i = 0; i < n; i++, p += alen) {
+    std::memcpy(p, addrs[i], alen);
+    list[i] = p;
+  }
+  list[n] = nullptr;
+  aliases[0] = nullptr;
+  std::memcpy(p, name.data(), name.size());
+  p[name.size()] = 0;
+
+  ret->h_name = p;
+  ret->h_aliases = aliases;
+  ret->h_addrtype = af;
+  ret->h_length = (int)alen;
+  ret->h_addr_list = list;
+  return 0;
+}
+
+// Addresses of family af in g_policy order.
+static uint32_t collect_addrs(const LoadedTable& t, const HostEntry& e, int af,
+                              unsigned char (*out)[16]) {
+  uint32_t first = pick_first(t, e), n = 0;
+  for (uint32_t i = 0; i < e.addr_count; i++) {
+    const HostAddr& addr = t.table.addr(e, first, i);
+    if (addr.family != af) continue;
+    if (af == AF_INET) std::memcpy(out[n++], &addr.v4, sizeof(in_addr));
+    else std::memcpy(out[n++], &addr.v6, sizeof(in6_addr));
+  }
+  return n;
+}
+
+static int hostent_r(const char* name, int af, const LoadedTable& t, const HostEntry& e,
+                     hostent* ret, char* buf, size_t buflen, hostent** result, int* h_errnop) {
+  unsigned char addrs[kMaxAddrsPerHost][16];
+  uint32_t n = collect_addrs(t, e, af, addrs);
+  *result = nullptr;
+  if (!n) {
+    *h_errnop = NO_DATA;
+    return ENOENT;
+  }
+  if (write_hostent(ret, buf, buflen, name, af, addrs, n) != 0) {
+    *h_errnop = NETDB_INTERNAL;
+    return ERANGE;
+  }
+  *result = ret;
+  *h_errnop = 0;
+  return 0;
+}
+
+static hostent* make_hostent(const char* name, const LoadedTable& t, const HostEntry& e, int af) {
+  hostent* result;
+  int herr;
+  hostent_r(name, af, t, e, &g_hostent.he, g_hostent.buf, sizeof(g_hostent.buf), &result, &herr);
+  if (!result) h_errno = herr;
+  return result;
+}
+
+OVERRIDEHOSTS_EXPORT struct hostent* gethostbyname(const char* name) {
+  ensure_inited();
+  {
+    TableRef ref;
+    if (const HostEntry* e = lookup_ip_for(name, ref)) return make_hostent(name, *ref.t, *e, AF_INET);
+  }
 
-static hostent* make_hostent_v4(const std::string& name, const std::string& ip) {
-  in_addr a4{};
-  if (inet_pton(AF_INET, ip.c_str(), &a4) != 1) return nullptr;
+  return g_real.gethostbyname ? g_real.gethostbyname(name) : nullptr;
+}
+
+OVERRIDEHOSTS_EXPORT struct hostent* gethostbyname2(const char* name, int af) {
+  ensure_inited();
+  {
+    TableRef ref;
+    if (const HostEntry* e = lookup_ip_for(name, ref)) {
+      if (af == AF_INET || af == AF_INET6) return make_hostent(name, *ref.t, *e, af);
+      h_errno = NO_RECOVERY;
+      return nullptr;
+    }
+  }
 
-  g_name = name;
-  g_ip_str = ip;
+  return g_real.gethostbyname2 ? g_real.gethostbyname2(name, af) : nullptr;
+}
 
-  g_addr_storage.resize(sizeof(in_addr));
-  std::memcpy(g_addr_storage.data(), &a4, sizeof(in_addr));
 
-  g_addr_list.clear();
-  g_addr_list.push_back((char*)g_addr_storage.data());
-  g_addr_list.push_back(nullptr);
+OVERRIDEHOSTS_EXPORT int gethostbyname_r(const char* name, struct hostent* ret, char* buf, size_t buflen,
+                               struct hostent** result, int* h_errnop) {
+  ensure_inited();
+  {
+    TableRef ref;
+    if (const HostEntry* e = lookup_ip_for(name, ref))
+      return hostent_r(name, AF_INET, *ref.t, *e, ret, buf, buflen, result, h_errnop);
+  }
 
-  std::memset(&g_he, 0, sizeof(g_he));
-  g_he.h_name = (char*)g_name.c_str();
-  g_he.h_aliases = nullptr;
-  g_he.h_addrtype = AF_INET;
-  g_he.h_length = sizeof(in_addr);
-  g_he.h_addr_list = g_addr_list.data();
-  return &g_he;
+  if (!g_real.gethostbyname_r) {
+    *result = nullptr;
+    *h_errnop = NO_RECOVERY;
+    return ENOSYS;
+  }
+  return g_real.gethostbyname_r(name, ret, buf, buflen, result, h_errnop);
 }
 
-extern "C" struct hostent* gethostbyname(const char* name) {
-  static real_gethostbyname_t real_gethostbyname =
-      (real_gethostbyname_t)dlsym(RTLD_NEXT, "gethostbyname");
+OVERRIDEHOSTS_EXPORT int gethostbyname2_r(const char* name, int af, struct hostent* ret, char* buf, size_t buflen,
+                                struct hostent** result, int* h_errnop) {
+  ensure_inited();
+  if (af == AF_INET || af == AF_INET6) {
+    TableRef ref;
+    if (const HostEntry* e = lookup_ip_for(name, ref))
+      return hostent_r(name, af, *ref.t, *e, ret, buf, buflen, result, h_errnop);
+  }
 
-  std::string ip;
-  if (lookup_ip_for(name, ip)) {
-    // This legacy API only supports v4 cleanly. If you need v6, use getaddrinfo in your program.
-    return make_hostent_v4(name ? name : "", ip);
+  if (!g_real.gethostbyname2_r) {
+    *result = nullptr;
+    *h_errnop = NO_RECOVERY;
+    return ENOSYS;
   }
+  return g_real.gethostbyname2_r(name, af, ret, buf, buflen, result, h_errnop);
+}
 
-  return real_gethostbyname ? real_gethostbyname(name) : nullptr;
+// --- reverse lookups (getnameinfo / gethostbyaddr) ---
+// Served from the IP -> name index of the current table; the answer is the
+// name as it was written in the mapping.
+
+static bool addr_len_ok(int af, socklen_t len) {
+  return (af == AF_INET && len >= sizeof(in_addr)) || (af == AF_INET6 && len >= sizeof(in6_addr));
+}
+
+// Reverse-lookup hostent: the entry's name plus the queried address.
+static int reverse_hostent_r(const void* addr, int af, TableRef& ref, const HostEntry& e,
+                             hostent* ret, char* buf, size_t buflen, hostent** result, int* h_errnop) {
+  unsigned char a[1][16];
+  std::memcpy(a[0], addr, af == AF_INET ? sizeof(in_addr) : sizeof(in6_addr));
+  *result = nullptr;
+  if (write_hostent(ret, buf, buflen, ref.t->table.name(e), af, a, 1) != 0) {
+    *h_errnop = NETDB_INTERNAL;
+    return ERANGE;
+  }
+  *result = ret;
+  *h_errnop = 0;
+  return 0;
 }
 
-extern "C" struct hostent* gethostbyname2(const char* name, int af) {
-  static real_gethostbyname2_t real_gethostbyname2 =
-      (real_gethostbyname2_t)dlsym(RTLD_NEXT, "gethostbyname2");
+OVERRIDEHOSTS_EXPORT int getnameinfo(const struct sockaddr* sa, socklen_t salen, char* host, socklen_t hostlen,
+                           char* serv, socklen_t servlen, int flags) {
+  ensure_inited();
+  if (sa && host && hostlen && !(flags & NI_NUMERICHOST)) {
+    const void* addr = nullptr;
+    if (sa->sa_family == AF_INET && salen >= sizeof(sockaddr_in))
+      addr = &((const sockaddr_in*)sa)->sin_addr;
+    else if (sa->sa_family == AF_INET6 && salen >= sizeof(sockaddr_in6))
+      addr = &((const sockaddr_in6*)sa)->sin6_addr;
 
-  std::string ip;
-  if (lookup_ip_for(name, ip)) {
-    if (af == AF_INET) return make_hostent_v4(name ? name : "", ip);
-    // For AF_INET6 callers, rely on getaddrinfo path; return nullptr here.
-    return nullptr;
+    bool hit = false;
+    if (addr) {
+      TableRef ref;
+      if (const HostEntry* e = lookup_name_for(sa->sa_family, addr, ref)) {
+        std::string_view n = ref.t->table.name(*e);
+        if (n.size() >= hostlen) return EAI_OVERFLOW;
+        std::memcpy(host, n.data(), n.size());
+        host[n.size()] = 0;
+        hit = true;
+      }
+    }
+    if (hit) {
+      if (!serv || !servlen) return 0;
+      // The service half is not ours; let libc format it.
+      return g_real.getnameinfo ? g_real.getnameinfo(sa, salen, nullptr, 0, serv, servlen, flags) : EAI_FAIL;
+    }
+  }
+
+  return g_real.getnameinfo ? g_real.getnameinfo(sa, salen, host, hostlen, serv, servlen, flags) : EAI_FAIL;
+}
+
+OVERRIDEHOSTS_EXPORT int gethostbyaddr_r(const void* addr, socklen_t len, int type, struct hostent* ret,
+                               char* buf, size_t buflen, struct hostent** result, int* h_errnop) {
+  ensure_inited();
+  if (addr && addr_len_ok(type, len)) {
+    TableRef ref;
+    if (const HostEntry* e = lookup_name_for(type, addr, ref))
+      return reverse_hostent_r(addr, type, ref, *e, ret, buf, buflen, result, h_errnop);
+  }
+
+  if (!g_real.gethostbyaddr_r) {
+    *result = nullptr;
+    *h_errnop = NO_RECOVERY;
+    return ENOSYS;
+  }
+  return g_real.gethostbyaddr_r(addr, len, type, ret, buf, buflen, result, h_errnop);
+}
+
+OVERRIDEHOSTS_EXPORT struct hostent* gethostbyaddr(const void* addr, socklen_t len, int type) {
+  ensure_inited();
+  if (addr && addr_len_ok(type, len)) {
+    TableRef ref;
+    if (const HostEntry* e = lookup_name_for(type, addr, ref)) {
+      hostent* result;
+      int herr;
+      reverse_hostent_r(addr, type, ref, *e, &g_hostent.he, g_hostent.buf, sizeof(g_hostent.buf), &result, &herr);
+      if (!result) h_errno = herr;
+      return result;
+    }
+  }
+
+  return g_real.gethostbyaddr ? g_real.gethostbyaddr(addr, len, type) : nullptr;
+}
+
+// --- c-ares override (OVERRIDEHOSTS_ARES=0 turns it off) ---
+// Event-loop programs often resolve through c-ares instead of libc. For an
+// overridden name ares_getaddrinfo() and ares_gethostbyname() run the
+// callback before returning, as c-ares does for numeric hosts, so the loop
+// never waits; everything else goes to the real c-ares, found when first
+// needed since it may be loaded after us. The structs mirror ares.h (stable
+// since c-ares 1.16), so building needs no c-ares headers. Our results sit
+// in a pool slot, which is how ares_freeaddrinfo() tells them apart.
+
+struct AresAddrinfoNode {
+  int ai_ttl;
+  int ai_flags;
+  int ai_family;
+  int ai_socktype;
+  int ai_protocol;
+  unsigned int ai_addrlen;
+  struct sockaddr* ai_addr;
+  AresAddrinfoNode* ai_next;
+};
+
+struct AresAddrinfoCname {
+  int ttl;
+  char* alias;
+  char* name;
+  AresAddrinfoCname* next;
+};
+
+struct AresAddrinfo {
+  AresAddrinfoCname* cnames;
+  AresAddrinfoNode* nodes;
+  char* name;
+};
+
+struct AresAddrinfoHints {
+  int ai_flags;
+  int ai_family;
+  int ai_socktype;
+  int ai_protocol;
+};
+
+typedef void (*AresAddrinfoCallback)(void* arg, int status, int timeouts, AresAddrinfo* res);
+typedef void (*AresHostCallback)(void* arg, int status, int timeouts, struct hostent* host);
+
+constexpr int kAresSuccess = 0;
+constexpr int kAresENoData = 1;
+constexpr int kAresENotFound = 4;
+constexpr int kAresEBadFamily = 9;
+constexpr int kAresENoMem = 15;
+constexpr int kAresENotInitialized = 21;
+constexpr int kAresEService = 25;
+
+constexpr int kAresAiNumericServ = 1 << 3;
+constexpr int kAresAiV4Mapped = 1 << 4;
+constexpr int kAresAiAll = 1 << 5;
+constexpr int kAresAiAddrConfig = 1 << 6;
+
+struct AresAiNode {
+  AresAddrinfoNode ai;
+  SockAddrIn sa;
+};
+
+static bool g_ares = true;
+
+static void ares_init_env() {
+  const char* v = std::getenv("OVERRIDEHOSTS_ARES");
+  g_ares = !(v && std::strcmp(v, "0") == 0);
+}
+
+template <typename Fn>
+static Fn ares_next(std::atomic<Fn>& cache, const char* name) {
+  Fn fn = cache.load(std::memory_order_relaxed);
+  if (!fn) {
+    fn = (Fn)dlsym(RTLD_NEXT, name);
+    cache.store(fn, std::memory_order_relaxed);
+  }
+  return fn;
+}
+
+// One node per address like c-ares, carrying the hints' socket type and
+// protocol; the port is the service's for that protocol (tcp by default).
+static int make_ares_addrinfo(const char* name, const LoadedTable& t, const HostEntry& e, const char* service,
+                              const AresAddrinfoHints* hints, AresAddrinfo** res) {
+  int family = hints ? hints->ai_family : AF_UNSPEC;
+  int socktype = hints ? hints->ai_socktype : 0;
+  int protocol = hints ? hints->ai_protocol : 0;
+  int aflags = hints ? hints->ai_flags : 0;
+  int flags = ((aflags & kAresAiNumericServ) ? AI_NUMERICSERV : 0) | ((aflags & kAresAiV4Mapped) ? AI_V4MAPPED : 0) |
+              ((aflags & kAresAiAll) ? AI_ALL : 0) | ((aflags & kAresAiAddrConfig) ? AI_ADDRCONFIG : 0);
+  if (family != AF_UNSPEC && family != AF_INET && family != AF_INET6) return kAresEBadFamily;
+
+  AddrSelect sel;
+  if (!select_addrs(t, e, family, flags, sel)) return kAresENotFound;
+
+  ServicePorts ports;
+  if (resolve_service(service, flags, ports)) return kAresEService;
+  bool udp = socktype == SOCK_DGRAM || protocol == IPPROTO_UDP;
+  int port = !ports.given ? 0 : udp ? ports.udp : ports.tcp;
+  if (port < 0) return kAresEService;
+
+  void* slot = pool_alloc();
+  if (!slot) return kAresENoMem;
+  SlotWriter w{(char*)slot, (char*)slot + kSlotBytes};
+  AresAddrinfo* ai = (AresAddrinfo*)w.take(sizeof(AresAddrinfo));
+  size_t len = std::strlen(name) + 1;
+  ai->name = (char*)w.take(len);
+  if (ai->name) std::memcpy(ai->name, name, len);
+
+  AresAddrinfoNode** tail = &ai->nodes;
+  uint32_t first = pick_first(t, e);
+  for (uint32_t i = 0; i < e.addr_count; i++) {
+    const HostAddr& addr = t.table.addr(e, first, i);
+    bool v4 = addr.family == AF_INET;
+    if (v4 ? !(sel.want4 || sel.map4) : !sel.want6) continue;
+    bool mapped = v4 && !sel.want4;
+
+    AresAiNode* n = (AresAiNode*)w.take(sizeof(AresAiNode));
+    if (!n) break;
+    n->ai.ai_family = mapped ? AF_INET6 : addr.family;
+    n->ai.ai_socktype = socktype;
+    n->ai.ai_protocol = protocol;
+    n->ai.ai_addr = (sockaddr*)&n->sa;
+    n->ai.ai_addrlen = fill_sockaddr(n->sa, addr, mapped, port);
+    *tail = &n->ai;
+    tail = &n->ai.ai_next;
+  }
+
+  *res = ai;
+  return kAresSuccess;
+}
+
+// The table is unpinned by the time a callback runs, so a slow callback
+// cannot hold up a reload.
+static bool ares_answer(const char* name, const char* service, const AresAddrinfoHints* hints,
+                        int& status, AresAddrinfo*& res) {
+  TableRef ref;
+  const HostEntry* e = lookup_ip_for(name, ref);
+  if (!e) return false;
+  status = make_ares_addrinfo(name, *ref.t, *e, service, hints, &res);
+  return true;
+}
+
+OVERRIDEHOSTS_EXPORT void ares_getaddrinfo(void* channel, const char* name, const char* service,
+                                           const AresAddrinfoHints* hints, AresAddrinfoCallback callback,
+                                           void* arg) {
+  typedef void (*Fn)(void*, const char*, const char*, const AresAddrinfoHints*, AresAddrinfoCallback, void*);
+  static std::atomic<Fn> real{nullptr};
+  ensure_inited();
+  int status;
+  AresAddrinfo* res = nullptr;
+  if (g_ares && name && ares_answer(name, service, hints, status, res)) {
+    callback(arg, status, 0, res);
+    return;
+  }
+  if (Fn fn = ares_next(real, "ares_getaddrinfo")) fn(channel, name, service, hints, callback, arg);
+  else callback(arg, kAresENotInitialized, 0, nullptr);
+}
+
+OVERRIDEHOSTS_EXPORT void ares_freeaddrinfo(AresAddrinfo* ai) {
+  typedef void (*Fn)(AresAddrinfo*);
+  static std::atomic<Fn> real{nullptr};
+  if (!ai) return;
+  if (pool_owns(ai)) {
+    pool_free(ai);
+    return;
+  }
+  if (Fn fn = ares_next(real, "ares_freeaddrinfo")) fn(ai);
+}
+
+// AF_UNSPEC tries v6 first, then v4, as c-ares documents. The hostent is
+// written into buf, away from the table.
+static bool ares_host_answer(const char* name, int family, hostent& he, char* buf, size_t buflen,
+                             int& status, hostent*& result) {
+  TableRef ref;
+  const HostEntry* e = lookup_ip_for(name, ref);
+  if (!e) return false;
+  result = nullptr;
+  if (family != AF_INET && family != AF_INET6 && family != AF_UNSPEC) {
+    status = kAresEBadFamily;
+    return true;
+  }
+  int herr;
+  if (family == AF_UNSPEC) {
+    if (hostent_r(name, AF_INET6, *ref.t, *e, &he, buf, buflen, &result, &herr) != 0)
+      hostent_r(name, AF_INET, *ref.t, *e, &he, buf, buflen, &result, &herr);
+  } else {
+    hostent_r(name, family, *ref.t, *e, &he, buf, buflen, &result, &herr);
   }
+  status = result ? kAresSuccess : kAresENoData;
+  return true;
+}
 
-  return real_gethostbyname2 ? real_gethostbyname2(name, af) : nullptr;
+OVERRIDEHOSTS_EXPORT void ares_gethostbyname(void* channel, const char* name, int family,
+                                             AresHostCallback callback, void* arg) {
+  typedef void (*Fn)(void*, const char*, int, AresHostCallback, void*);
+  static std::atomic<Fn> real{nullptr};
+  ensure_inited();
+  hostent he;
+  char buf[kHostentBuf];
+  int status;
+  hostent* result;
+  if (g_ares && name && ares_host_answer(name, family, he, buf, sizeof(buf), status, result)) {
+    callback(arg, status, 0, result);
+    return;
+  }
+  if (Fn fn = ares_next(real, "ares_gethostbyname")) fn(channel, name, family, callback, arg);
+  else callback(arg, kAresENotInitialized, 0, nullptr);
 }
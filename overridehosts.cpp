@@ -6,32 +6,95 @@
 // Mapping format everywhere:
 //   host:ip
 //   IPv6 recommended as host:[2001:db8::1]
+//   Several addresses as host:ip1|ip2|ip3, optionally weighted as ip*3
+//   OVERRIDEHOSTS_POLICY=roundrobin|random rotates which one comes first
+//   *.example.com:ip matches names below example.com,
+//   .example.com:ip matches example.com too; exact names win, then the
+//   longest suffix
 //
 // Mapping sources (merged in order):
 //   1) OVERRIDEHOSTS environment variable (comma / whitespace separated)
-//   2) CLI args before "--"
+//   2) CLI args before "--", each one mapping or a list like OVERRIDEHOSTS;
+//      "@path" reads a list file in the same format
 // CLI mappings come last and therefore win.
 //
+// Large tables:
+//   overridehosts --compile hosts.img [mappings...]
+// writes a binary table that the library maps read-only; point children at
+// it with OVERRIDEHOSTS_FILE=hosts.img. OVERRIDEHOSTS, when set, wins.
+// OVERRIDEHOSTS_RELOAD=1 makes running processes pick up a rewritten file.
+//
+// The wrapper also builds the table once into a sealed memfd, inherited by
+// the whole process tree via OVERRIDEHOSTS_FD, so descendants map it
+// instead of parsing OVERRIDEHOSTS again. Lists too large for the
+// environment travel through the memfd alone.
+//
+// OVERRIDEHOSTS_CACHE_TTL=<seconds> caches real resolver answers for names
+// that are not overridden; OVERRIDEHOSTS_CACHE_NEG_TTL sets the TTL for
+// negative answers.
+// OVERRIDEHOSTS_COALESCE=1 lets concurrent identical lookups share one
+// resolver call.
+// OVERRIDEHOSTS_STATS=<path>|fd:<n> dumps lookup counters at exit and on
+// SIGUSR2 (Prometheus text format).
+//
+// Tracing:
+//   OVERRIDEHOSTS_TRACE=1 records every call that reaches the system
+//   resolver in a shared-memory ring;
+//   overridehosts --trace <pid> [-f] [host...] prints it (-f follows).
+//
+// Fork server:
+//   overridehosts --server <socket> [mappings...]
+//   overridehosts --client <socket> -- <command> [args...]
+// keeps the table built and spawns each command from the server with the
+// caller's stdio, cwd and environment (see overridehosts_server.h).
+//
 // Preload library selection:
-//   - liboverridehosts-musl.so if musl loader is present
-//   - liboverridehosts-glibc.so otherwise
+//   - liboverridehosts-musl.so if the target (found via PATH, through any
+//     "#!" interpreter) uses the musl dynamic loader
+//   - liboverridehosts-glibc.so for glibc targets; targets that cannot be
+//     classified get the wrapper's own libc
 //   - OVERRIDEHOSTS_SO overrides everything
 //
 // Usage:
 //   ./overridehosts "example:192.168.0.1" -- ping example
 //   OVERRIDEHOSTS="db:10.0.0.10,redis:10.0.0.11" ./overridehosts -- wget http://db/
+//   ./overridehosts --compile /etc/myhosts.img @hosts.txt
+//   OVERRIDEHOSTS_FILE=/etc/myhosts.img ./overridehosts -- ./server
 
 #include <cerrno>
+#include <cstddef>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
+#include <arpa/inet.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <limits.h>
 
+#include "overridehosts_launch.h"
+#include "overridehosts_parse.h"
+#include "overridehosts_server.h"
+#include "overridehosts_table.h"
+#include "overridehosts_trace.h"
+
 static void die(const std::string& msg) {
   std::cerr << "overridehosts: " << msg << "\n";
   std::exit(1);
@@ -51,31 +114,71 @@ static std::string get_exe_dir() {
   return (pos == std::string::npos) ? "." : full.substr(0, pos);
 }
 
-static bool looks_like_mapping(const std::string& s) {
-  return !s.empty() && s[0] != '-' && s.find(':') != std::string::npos;
+// Every mapping is checked here, once, so children can trust what we
+// export (see overridehosts::kCanonicalTag).
+static void add_checked(std::string_view item, std::vector<std::string>& out) {
+  overridehosts::Mapping m;
+  if (!overridehosts::split_mapping(item, m) || !overridehosts::valid_host(m.host) ||
+      !overridehosts::valid_addr_list(m.addrs))
+    die("invalid mapping: " + std::string(item));
+  out.emplace_back(item);
+}
+
+static void split_mappings(std::string_view s, std::vector<std::string>& out) {
+  size_t bad = overridehosts::for_each_mapping(s, [&](std::string_view item, const overridehosts::Mapping&) {
+    add_checked(item, out);
+  });
+  if (bad) die("malformed item in mapping list (expected host:ip)");
+}
+
+static std::string format_addr(const overridehosts::HostAddr& a) {
+  char buf[INET6_ADDRSTRLEN];
+  ::inet_ntop(a.family, a.family == AF_INET ? (const void*)&a.v4 : (const void*)&a.v6, buf, sizeof(buf));
+  return a.family == AF_INET ? std::string(buf) : "[" + std::string(buf) + "]";
 }
 
+// OVERRIDEHOSTS as exported by an outer overridehosts is in canonical form;
+// turn it back into mappings so they merge like any others.
 static void parse_env_overridehosts(std::vector<std::string>& out) {
   const char* env = std::getenv("OVERRIDEHOSTS");
   if (!env || !*env) return;
-
-  std::string s(env);
-  std::string cur;
-
-  auto flush = [&]() {
-    if (!cur.empty()) {
-      if (looks_like_mapping(cur)) out.push_back(cur);
-      cur.clear();
+  if (!overridehosts::is_canonical(env)) {
+    split_mappings(env, out);
+    return;
+  }
+  bool ok = overridehosts::for_each_canonical(env, [&](std::string_view host, const overridehosts::HostAddr* a,
+                                                        const uint32_t* w, uint32_t n) {
+    std::string item(host);
+    for (uint32_t i = 0; i < n; i++) {
+      item += i ? "|" : ":";
+      item += format_addr(a[i]);
+      if (w[i] != 1) item += "*" + std::to_string(w[i]);
     }
-  };
+    out.push_back(item);
+  });
+  if (!ok) die("OVERRIDEHOSTS holds a damaged canonical table");
+}
+
+static void read_mapping_file(const std::string& path, std::vector<std::string>& out) {
+  std::ifstream in(path);
+  if (!in) die("cannot read mapping file: " + path);
+  std::ostringstream ss;
+  ss << in.rdbuf();
+  split_mappings(ss.str(), out);
+}
 
-  for (char c : s) {
-    if (c == ',' || c == ' ' || c == '\t' || c == '\n' || c == '\r')
-      flush();
-    else
-      cur.push_back(c);
+static void add_mapping_arg(const char* arg, std::vector<std::string>& out) {
+  if (arg[0] == '@') {
+    read_mapping_file(arg + 1, out);
+    return;
   }
-  flush();
+  // One argument may hold a list, as OVERRIDEHOSTS does ("a:ip,b:ip").
+  std::vector<std::string_view> items;
+  size_t bad = overridehosts::for_each_mapping(arg, [&](std::string_view item, const overridehosts::Mapping&) {
+    items.push_back(item);
+  });
+  if (bad || items.empty()) die(std::string("unexpected argument before '--': ") + arg);
+  for (std::string_view item : items) add_checked(item, out);
 }
 
 static std::string join_csv(const std::vector<std::string>& v) {
@@ -87,73 +190,500 @@ static std::string join_csv(const std::vector<std::string>& v) {
   return oss.str();
 }
 
-static bool is_musl_runtime() {
-  return
-    ::access("/lib/ld-musl-x86_64.so.1", R_OK) == 0 ||
-    ::access("/lib/ld-musl-aarch64.so.1", R_OK) == 0 ||
-    ::access("/lib/ld-musl-armhf.so.1", R_OK) == 0 ||
-    ::access("/lib/ld-musl-i386.so.1", R_OK) == 0 ||
-    ::access("/lib/ld-musl-riscv64.so.1", R_OK) == 0;
+// Writes next to the target and renames, so readers never map a partial
+// image.
+static int compile_table(const std::string& out, const std::vector<std::string>& mappings) {
+  overridehosts::TableBuilder b;
+  b.add_text(join_csv(mappings));
+  std::vector<char> image = b.finish();
+
+  std::string tmp = out + ".tmp." + std::to_string(::getpid());
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) die("cannot create " + tmp + ": " + std::strerror(errno));
+  size_t off = 0;
+  while (off < image.size()) {
+    ssize_t n = ::write(fd, image.data() + off, image.size() - off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) { ::unlink(tmp.c_str()); die("write failed: " + tmp); }
+    off += (size_t)n;
+  }
+  if (::close(fd) != 0 || ::rename(tmp.c_str(), out.c_str()) != 0) {
+    ::unlink(tmp.c_str());
+    die("cannot write " + out + ": " + std::strerror(errno));
+  }
+  return 0;
+}
+
+// Builds the table image into a sealed memfd that stays open across exec,
+// so every descendant maps the same pages instead of parsing OVERRIDEHOSTS.
+// Returns -1 if memfds are unavailable; the environment still works then.
+static int table_memfd(const std::vector<char>& image) {
+  int fd = ::memfd_create("overridehosts", MFD_ALLOW_SEALING);
+  if (fd < 0) return -1;
+  size_t off = 0;
+  while (off < image.size()) {
+    ssize_t n = ::write(fd, image.data() + off, image.size() - off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) { ::close(fd); return -1; }
+    off += (size_t)n;
+  }
+  if (::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Children get the deduplicated (last one wins) and validated table in
+// canonical form and skip parsing it again.
+struct Export {
+  std::string canonical;
+  bool fits = false;  // small enough to export as OVERRIDEHOSTS
+  int memfd = -1;
+  std::string fd_spec;  // value for OVERRIDEHOSTS_FD
+};
+
+static Export export_table(const std::vector<std::string>& mappings) {
+  Export ex;
+  overridehosts::TableBuilder builder;
+  for (const std::string& m : mappings) builder.add_text(m);
+  ex.canonical = builder.encode_canonical();
+  ex.fits = ex.canonical.size() + sizeof("OVERRIDEHOSTS=") <= overridehosts::kMaxEnvBytes;
+  ex.memfd = mappings.empty() ? -1 : table_memfd(builder.finish());
+  if (!ex.fits && ex.memfd < 0)
+    die("mapping list is " + std::to_string(ex.canonical.size()) + " bytes, too large for the environment;"
+        "\nuse --compile <file> and OVERRIDEHOSTS_FILE=<file>");
+  if (ex.memfd >= 0) {
+    char hash[24] = "-";
+    if (ex.fits) std::snprintf(hash, sizeof(hash), "%llx", (unsigned long long)overridehosts::text_hash(ex.canonical));
+    ex.fd_spec = std::to_string(ex.memfd) + "," + hash;
+  }
+  return ex;
+}
+
+static void check_preload_so(const std::string& exe_dir, const std::string& so_path) {
+  if (!exists(so_path)) {
+    die(
+      "preload library not found:\n  " + so_path +
+      "\nExpected:\n  " + exe_dir + "/liboverridehosts-glibc.so"
+      "\n  " + exe_dir + "/liboverridehosts-musl.so"
+      "\nOr set OVERRIDEHOSTS_SO"
+    );
+  }
+}
+
+// Prints the trace ring of a process started with OVERRIDEHOSTS_TRACE.
+// Hashes of the names given on the command line are printed as names.
+static int drain_trace(const std::string& pid_arg, bool follow, const std::vector<std::string>& names) {
+  char* end;
+  long pid = std::strtol(pid_arg.c_str(), &end, 10);
+  if (*end || pid <= 0) die("bad pid: " + pid_arg);
+
+  char shm[64];
+  overridehosts::trace_shm_name(pid, shm, sizeof(shm));
+  int fd = ::shm_open(shm, O_RDONLY, 0);
+  if (fd < 0) die(std::string("no trace ring for pid ") + pid_arg + " (started with OVERRIDEHOSTS_TRACE=1?)");
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(overridehosts::TraceHeader)) die("trace ring is truncated");
+  void* p = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) die(std::string("mmap failed: ") + std::strerror(errno));
+
+  const overridehosts::TraceHeader* h = (const overridehosts::TraceHeader*)p;
+  if (std::memcmp(h->magic, overridehosts::kTraceMagic, sizeof(h->magic)) != 0 ||
+      h->version != overridehosts::kTraceVersion || h->capacity == 0 ||
+      (h->capacity & (h->capacity - 1)) || overridehosts::trace_bytes(h->capacity) > (size_t)st.st_size)
+    die("not a trace ring of this version");
+
+  std::vector<std::pair<uint32_t, const std::string*>> known;
+  for (const std::string& n : names) known.push_back({overridehosts::hash_name(n), &n});
+
+  uint64_t next = 0;
+  for (;;) {
+    uint64_t head = h->head.load(std::memory_order_acquire);
+    if (head - next > h->capacity) {
+      uint64_t first = head - h->capacity;
+      if (next) std::cout << "# dropped " << (first - next) << " records\n";
+      next = first;
+    }
+    for (; next < head; next++) {
+      overridehosts::TraceEntry e;
+      if (!overridehosts::trace_read(h, next, e)) continue;  // overwritten or still being written
+
+      time_t sec = (time_t)(e.wall_ns / 1000000000ull);
+      struct tm tm;
+      char when[32];
+      ::gmtime_r(&sec, &tm);
+      ::strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+      char frac[16];
+      std::snprintf(frac, sizeof(frac), ".%06lluZ", (unsigned long long)(e.wall_ns % 1000000000ull / 1000));
+
+      std::cout << when << frac;
+      const std::string* name = nullptr;
+      for (auto& k : known) if (k.first == e.hash) name = k.second;
+      if (name) std::cout << " host=" << *name;
+      else {
+        char hash[16];
+        std::snprintf(hash, sizeof(hash), "%08x", e.hash);
+        std::cout << " hash=" << hash;
+      }
+      char dur[32];
+      std::snprintf(dur, sizeof(dur), "%.1f", (double)e.duration_ns / 1000.0);
+      std::cout << " rc=" << e.rc << " duration_us=" << dur;
+      if (e.rc) std::cout << " error=\"" << ::gai_strerror(e.rc) << "\"";
+      std::cout << "\n";
+    }
+    std::cout.flush();
+    if (!follow || ::kill((pid_t)pid, 0) != 0) break;
+    ::usleep(100000);
+  }
+  return 0;
+}
+
+// --- fork server ---
+//
+// --server keeps the table (memfd + canonical text) built once and spawns
+// each requested command with posix_spawn (vfork-style in glibc and musl),
+// so the per-child cost is one connection instead of a wrapper exec plus
+// table build. Protocol: overridehosts_server.h.
+
+static char g_server_path[sizeof(((sockaddr_un*)nullptr)->sun_path)];
+
+static void on_server_signal(int) {
+  ::unlink(g_server_path);
+  ::_exit(0);
+}
+
+static bool read_full(int fd, void* buf, size_t len) {
+  char* p = (char*)buf;
+  while (len) {
+    ssize_t n = ::read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool write_full(int fd, const void* buf, size_t len) {
+  const char* p = (const char*)buf;
+  while (len) {
+    ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static sockaddr_un socket_addr(const std::string& path) {
+  sockaddr_un sa = {};
+  sa.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(sa.sun_path)) die("bad socket path: " + path);
+  std::memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+  return sa;
+}
+
+struct Server {
+  Export ex;
+  std::string exe_dir;
+  std::string map_file;  // passed on when there are no mappings of our own
+};
+
+static int spawn_request(const Server& srv, const std::vector<std::string_view>& strs, uint32_t argc, const int* fds) {
+  const std::string path(strs[0]);
+  const std::string cwd(strs[1]);
+  if (path.empty() || path[0] != '/') return -EINVAL;
+  std::string so_path = overridehosts::select_preload_so(srv.exe_dir, path);
+  if (!exists(so_path)) return -ENOENT;
+
+  std::vector<char*> argp, base;
+  for (size_t i = 2; i < strs.size(); i++) (i < 2 + argc ? argp : base).push_back((char*)strs[i].data());
+  argp.push_back(nullptr);
+  base.push_back(nullptr);
+  // Without a memfd the text alone carries the table, as in main(). The
+  // caller's OVERRIDEHOSTS_FILE is kept unless we serve one ourselves.
+  bool own = srv.map_file.empty();
+  std::vector<overridehosts::EnvSet> set = {
+    {"OVERRIDEHOSTS", own && srv.ex.fits ? &srv.ex.canonical : nullptr},
+    {"OVERRIDEHOSTS_FD", srv.ex.memfd >= 0 ? &srv.ex.fd_spec : nullptr},
+  };
+  if (!own) set.push_back({"OVERRIDEHOSTS_FILE", &srv.map_file});
+  overridehosts::ChildEnv env;
+  overridehosts::build_child_env(env, base.data(), so_path, set);
+
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  ::posix_spawn_file_actions_init(&fa);
+  for (int i = 0; i < 3; i++) ::posix_spawn_file_actions_adddup2(&fa, fds[i], i);
+  if (!cwd.empty()) ::posix_spawn_file_actions_addchdir_np(&fa, cwd.c_str());
+  ::posix_spawnattr_init(&attr);
+  sigset_t none, all;
+  sigemptyset(&none);
+  sigfillset(&all);
+  ::posix_spawnattr_setsigmask(&attr, &none);
+  ::posix_spawnattr_setsigdefault(&attr, &all);
+  short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_USEVFORK
+  flags |= POSIX_SPAWN_USEVFORK;
+#endif
+  ::posix_spawnattr_setflags(&attr, flags);
+
+  pid_t pid;
+  int rc = ::posix_spawn(&pid, path.c_str(), &fa, &attr, argp.data(), env.envp.data());
+  ::posix_spawn_file_actions_destroy(&fa);
+  ::posix_spawnattr_destroy(&attr);
+  return rc == 0 ? (int)pid : -rc;
+}
+
+// One connection: receive, spawn, report the pid, wait, report the status.
+static void serve_connection(const Server& srv, int conn) {
+  overridehosts::SpawnRequest req;
+  int fds[3] = {-1, -1, -1};
+  alignas(cmsghdr) char ctl[CMSG_SPACE(sizeof(fds))];
+  iovec iov = {&req, sizeof(req)};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl;
+  msg.msg_controllen = sizeof(ctl);
+  ssize_t n = ::recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  size_t nfds = 0;
+  for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+    size_t got = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < got; i++) {
+      int fd;
+      std::memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+      if (nfds < 3) fds[nfds++] = fd;
+      else ::close(fd);
+    }
+  }
+
+  int32_t reply = -EPROTO;
+  std::string body;
+  std::vector<std::string_view> strs;
+  if (n == (ssize_t)sizeof(req) && nfds == 3 && !(msg.msg_flags & MSG_CTRUNC) &&
+      std::memcmp(req.magic, overridehosts::kSpawnMagic, sizeof(req.magic)) == 0 &&
+      req.bytes <= overridehosts::kSpawnMaxBytes && req.argc > 0) {
+    body.resize(req.bytes);
+    if (read_full(conn, &body[0], body.size())) {
+      for (size_t p = 0; p < body.size();) {
+        size_t z = body.find('\0', p);
+        if (z == std::string::npos) break;
+        strs.emplace_back(body.data() + p, z - p);
+        p = z + 1;
+      }
+      if (strs.size() == 2 + (size_t)req.argc + req.envc) reply = spawn_request(srv, strs, req.argc, fds);
+    }
+  }
+  for (int fd : fds)
+    if (fd >= 0) ::close(fd);
+
+  if (write_full(conn, &reply, sizeof(reply)) && reply > 0) {
+    int status = 0;
+    while (::waitpid((pid_t)reply, &status, 0) < 0 && errno == EINTR) {}
+    int32_t st = status;
+    write_full(conn, &st, sizeof(st));
+  } else if (reply > 0) {
+    while (::waitpid((pid_t)reply, nullptr, 0) < 0 && errno == EINTR) {}
+  }
+  ::close(conn);
+}
+
+static int run_server(const std::string& path, const std::vector<std::string>& mappings) {
+  const char* map_file = std::getenv("OVERRIDEHOSTS_FILE");
+  if (mappings.empty() && !(map_file && *map_file))
+    die("no mappings provided (use args, OVERRIDEHOSTS or OVERRIDEHOSTS_FILE)");
+
+  Server srv;
+  srv.ex = export_table(mappings);
+  srv.exe_dir = get_exe_dir();
+  if (mappings.empty()) srv.map_file = map_file;
+
+  sockaddr_un sa = socket_addr(path);
+  int ls = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (ls < 0) die(std::string("socket failed: ") + std::strerror(errno));
+  // The socket runs commands as us: only we may connect (0600, and the
+  // peer check below).
+  mode_t old_mask = ::umask(0177);
+  if (::bind(ls, (sockaddr*)&sa, sizeof(sa)) != 0) {
+    if (errno != EADDRINUSE) die("bind " + path + ": " + std::strerror(errno));
+    // Only take over the path if nobody is listening on it.
+    int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool live = ::connect(probe, (sockaddr*)&sa, sizeof(sa)) == 0;
+    ::close(probe);
+    if (live) die("another server is listening on " + path);
+    ::unlink(path.c_str());
+    if (::bind(ls, (sockaddr*)&sa, sizeof(sa)) != 0) die("bind " + path + ": " + std::strerror(errno));
+  }
+  ::umask(old_mask);
+  if (::listen(ls, SOMAXCONN) != 0) die(std::string("listen failed: ") + std::strerror(errno));
+
+  std::memcpy(g_server_path, sa.sun_path, sizeof(g_server_path));
+  ::signal(SIGINT, on_server_signal);
+  ::signal(SIGTERM, on_server_signal);
+  ::signal(SIGHUP, on_server_signal);
+  ::signal(SIGPIPE, SIG_IGN);
+
+  for (;;) {
+    int conn = ::accept4(ls, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) continue;
+      die(std::string("accept failed: ") + std::strerror(errno));
+    }
+    ucred peer;
+    socklen_t len = sizeof(peer);
+    if (::getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &len) != 0 || peer.uid != ::geteuid()) {
+      ::close(conn);
+      continue;
+    }
+    std::thread(serve_connection, std::cref(srv), conn).detach();
+  }
 }
 
-static std::string select_preload_so(const std::string& exe_dir) {
-  if (const char* p = std::getenv("OVERRIDEHOSTS_SO"); p && *p)
-    return std::string(p);
+static pid_t g_client_child;
 
-  return exe_dir + (is_musl_runtime()
-    ? "/liboverridehosts-musl.so"
-    : "/liboverridehosts-glibc.so");
+static void forward_signal(int sig) {
+  if (g_client_child > 0) ::kill(g_client_child, sig);
 }
 
-static void setenv_or_die(const char* k, const std::string& v) {
-  if (::setenv(k, v.c_str(), 1) != 0)
-    die(std::string("setenv(") + k + ") failed: " + std::strerror(errno));
+// Runs argv through a --server and exits like the child did.
+static int run_client(const std::string& path, char** argv) {
+  std::string cmd = overridehosts::resolve_command(argv[0]);
+  if (cmd.empty()) die(argv[0] + std::string(": ") + std::strerror(ENOENT));
+  char cwd[PATH_MAX];
+  if (!::getcwd(cwd, sizeof(cwd))) die(std::string("getcwd failed: ") + std::strerror(errno));
+  if (cmd[0] != '/') cmd = std::string(cwd) + "/" + cmd;
+
+  std::string body;
+  auto add = [&](const char* s) { body.append(s, std::strlen(s) + 1); };
+  add(cmd.c_str());
+  add(cwd);
+  overridehosts::SpawnRequest req;
+  std::memcpy(req.magic, overridehosts::kSpawnMagic, sizeof(req.magic));
+  req.argc = 0;
+  for (char** a = argv; *a; a++, req.argc++) add(*a);
+  req.envc = 0;
+  for (char** e = environ; *e; e++, req.envc++) add(*e);
+  if (body.size() > overridehosts::kSpawnMaxBytes) die("command line and environment are too large");
+  req.bytes = (uint32_t)body.size();
+
+  sockaddr_un sa = socket_addr(path);
+  int s = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s < 0 || ::connect(s, (sockaddr*)&sa, sizeof(sa)) != 0)
+    die("cannot connect to " + path + ": " + std::strerror(errno));
+
+  int fds[3] = {0, 1, 2};
+  alignas(cmsghdr) char ctl[CMSG_SPACE(sizeof(fds))] = {};
+  iovec iov = {&req, sizeof(req)};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl;
+  msg.msg_controllen = sizeof(ctl);
+  cmsghdr* c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(fds));
+  std::memcpy(CMSG_DATA(c), fds, sizeof(fds));
+  if (::sendmsg(s, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(req) || !write_full(s, body.data(), body.size()))
+    die(std::string("cannot send request: ") + std::strerror(errno));
+
+  int32_t pid;
+  if (!read_full(s, &pid, sizeof(pid))) die("server closed the connection");
+  if (pid < 0) die(cmd + ": " + std::strerror(-pid));
+
+  g_client_child = (pid_t)pid;
+  struct sigaction sa_fwd = {};
+  sa_fwd.sa_handler = forward_signal;
+  for (int sig : {SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGUSR1, SIGUSR2}) ::sigaction(sig, &sa_fwd, nullptr);
+
+  int32_t status;
+  if (!read_full(s, &status, sizeof(status))) die("server closed the connection");
+  if (WIFEXITED(status)) return WEXITSTATUS(status);
+  int sig = WTERMSIG(status);
+  ::signal(sig, SIG_DFL);
+  ::raise(sig);
+  return 128 + sig;
 }
 
 int main(int argc, char** argv) {
+  if (argc >= 3 && std::string(argv[1]) == "--trace") {
+    bool follow = false;
+    std::vector<std::string> names;
+    for (int i = 3; i < argc; i++) {
+      if (std::string(argv[i]) == "-f") follow = true;
+      else names.push_back(argv[i]);
+    }
+    return drain_trace(argv[2], follow, names);
+  }
+
+  // The server builds the child's environment, not the client.
+  if (argc >= 5 && std::string(argv[1]) == "--client" && std::string(argv[3]) == "--")
+    return run_client(argv[2], &argv[4]);
+
   std::vector<std::string> mappings;
   parse_env_overridehosts(mappings);
 
+  if (argc >= 3 && std::string(argv[1]) == "--server") {
+    for (int i = 3; i < argc; i++) add_mapping_arg(argv[i], mappings);
+    return run_server(argv[2], mappings);
+  }
+
+  if (argc >= 3 && std::string(argv[1]) == "--compile") {
+    for (int i = 3; i < argc; i++) add_mapping_arg(argv[i], mappings);
+    if (mappings.empty()) die("no mappings provided (use args and/or OVERRIDEHOSTS)");
+    return compile_table(argv[2], mappings);
+  }
+
   int sep = -1;
   for (int i = 1; i < argc; i++) {
     if (std::string(argv[i]) == "--") { sep = i; break; }
-    if (!looks_like_mapping(argv[i]))
-      die(std::string("unexpected argument before '--': ") + argv[i]);
-    mappings.push_back(argv[i]);
+    add_mapping_arg(argv[i], mappings);
   }
 
   if (sep == -1 || sep + 1 >= argc) {
     std::cerr
       << "Usage:\n"
       << "  " << argv[0] << " \"host:ip\" [\"host2:ip2\" ...] -- <command> [args...]\n"
-      << "  OVERRIDEHOSTS=\"host:ip,host2:ip2\" " << argv[0] << " -- <command>\n";
+      << "  OVERRIDEHOSTS=\"host:ip,host2:ip2\" " << argv[0] << " -- <command>\n"
+      << "  " << argv[0] << " --compile <out.img> [\"host:ip\" | @listfile ...]\n"
+      << "  " << argv[0] << " --trace <pid> [-f] [host ...]\n"
+      << "  " << argv[0] << " --server <socket> [\"host:ip\" | @listfile ...]\n"
+      << "  " << argv[0] << " --client <socket> -- <command> [args...]\n";
     return 2;
   }
 
-  if (mappings.empty())
-    die("no mappings provided (use args and/or OVERRIDEHOSTS)");
+  const char* map_file = std::getenv("OVERRIDEHOSTS_FILE");
+  bool have_file = map_file && *map_file;
+  if (mappings.empty() && !have_file)
+    die("no mappings provided (use args, OVERRIDEHOSTS or OVERRIDEHOSTS_FILE)");
 
+  Export ex = export_table(mappings);
   std::string exe_dir = get_exe_dir();
-  std::string so_path = select_preload_so(exe_dir);
-
-  if (!exists(so_path)) {
-    die(
-      "preload library not found:\n  " + so_path +
-      "\nExpected:\n  " + exe_dir + "/liboverridehosts-glibc.so"
-      "\n  " + exe_dir + "/liboverridehosts-musl.so"
-      "\nOr set OVERRIDEHOSTS_SO"
-    );
-  }
+  std::string cmd = overridehosts::resolve_command(argv[sep + 1]);
+  if (cmd.empty()) die(argv[sep + 1] + std::string(": ") + std::strerror(ENOENT));
+  std::string so_path = overridehosts::select_preload_so(exe_dir, cmd);
+  check_preload_so(exe_dir, so_path);
 
-  setenv_or_die("OVERRIDEHOSTS", join_csv(mappings));
+  // Only LD_PRELOAD and the table entries change; everything else is
+  // passed through as the same pointers.
+  std::vector<overridehosts::EnvSet> set;
+  if (ex.memfd >= 0) set.push_back({"OVERRIDEHOSTS_FD", &ex.fd_spec});
+  if (!mappings.empty()) set.push_back({"OVERRIDEHOSTS", ex.fits ? &ex.canonical : nullptr});
+  overridehosts::ChildEnv env;
+  overridehosts::build_child_env(env, environ, so_path, set);
 
-  {
-    const char* old = std::getenv("LD_PRELOAD");
-    std::string preload = so_path;
-    if (old && *old) preload += std::string(" ") + old;
-    setenv_or_die("LD_PRELOAD", preload);
+  ::execve(cmd.c_str(), &argv[sep + 1], env.envp.data());
+  if (errno == ENOEXEC) {
+    // No "#!" line: run it with the shell, as execvp() would.
+    std::vector<char*> sh_argv = {(char*)"sh", &cmd[0]};
+    for (int i = sep + 2; i < argc; i++) sh_argv.push_back(argv[i]);
+    sh_argv.push_back(nullptr);
+    ::execve("/bin/sh", sh_argv.data(), env.envp.data());
   }
-
-  execvp(argv[sep + 1], &argv[sep + 1]);
-  die(std::string("execvp failed: ") + std::strerror(errno));
+  die(argv[sep + 1] + std::string(": ") + std::strerror(errno));
 }
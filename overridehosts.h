@@ -0,0 +1,220 @@
+// overridehosts.h
+//
+// In-process API.
+//
+// overridehosts_spawn() starts children under a hosts override without
+// going through the wrapper binary. Link liboverridehosts-spawn.a (built
+// by make) or build overridehosts_spawn.cpp into the program; the preload
+// libraries are looked up next to its executable, or at OVERRIDEHOSTS_SO.
+//
+// HostOverrideTable (C++, header-only) is the override engine itself, for
+// programs that want to resolve against it directly, with no environment
+// variables or LD_PRELOAD, or feed it to the preload library loaded in
+// the same process.
+
+#pragma once
+
+#include <spawn.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// posix_spawnp() with the override applied: file is searched in PATH,
+// the child gets envp (environ if null) with LD_PRELOAD pointing at the
+// preload library that matches file's C library and, when mappings is
+// non-null, OVERRIDEHOSTS set to it ("host:ip,host2:ip2", the wrapper's
+// syntax). Returns 0 or an errno value: EINVAL for a malformed mapping,
+// E2BIG if the list does not fit the environment, ENOENT if the preload
+// library is missing, or whatever posix_spawn() reports.
+int overridehosts_spawn(pid_t* pid, const char* file, const posix_spawn_file_actions_t* file_actions,
+                        const posix_spawnattr_t* attr, char* const argv[], char* const envp[],
+                        const char* mappings);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+
+#include <dlfcn.h>
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sched.h>
+#include <unistd.h>
+
+#include "overridehosts_parse.h"
+#include "overridehosts_table.h"
+
+namespace overridehosts {
+
+// Mapping table with the preload library's semantics: exact names first,
+// then the longest "*.suffix" / ".suffix" rule, case-insensitive.
+//
+// Every change builds a new immutable image and swaps it in with one
+// atomic store. lookup() is wait-free: it pins the image it reads by
+// bumping a per-thread counter stripe (see publish() in
+// liboverridehosts.cpp, which uses the same scheme). Writers are
+// serialized and free the old image once its readers are done. The table
+// must outlive every lookup running on it.
+class HostOverrideTable {
+ public:
+  HostOverrideTable() { current_.store(new Image(TableBuilder().finish())); }
+  ~HostOverrideTable() { delete current_.load(); }
+  HostOverrideTable(const HostOverrideTable&) = delete;
+  HostOverrideTable& operator=(const HostOverrideTable&) = delete;
+
+  // Adds a mapping list in the wrapper's syntax ("host:ip|ip*2, *.x:ip");
+  // a later mapping for a name replaces the earlier one. If any item is
+  // malformed, nothing changes and false is returned.
+  bool insert(std::string_view mappings) {
+    if (!valid_list(mappings)) return false;
+    std::lock_guard<std::mutex> lock(write_);
+    TableBuilder b;
+    b.add_canonical(canonical_);
+    b.add_text(mappings);
+    commit(b);
+    return true;
+  }
+
+  // One name, addresses already parsed, all with weight 1.
+  bool insert(std::string_view host, const HostAddr* addrs, size_t n) {
+    if (!valid_host(host) || n == 0 || n > kMaxAddrsPerHost) return false;
+    uint32_t w[kMaxAddrsPerHost];
+    for (size_t i = 0; i < n; i++) {
+      if (addrs[i].family != AF_INET && addrs[i].family != AF_INET6) return false;
+      w[i] = 1;
+    }
+    std::lock_guard<std::mutex> lock(write_);
+    TableBuilder b;
+    b.add_canonical(canonical_);
+    b.add_parsed(host, addrs, w, (uint32_t)n);
+    commit(b);
+    return true;
+  }
+
+  // Swaps the whole table for mappings in one step: a concurrent lookup
+  // sees either the old set or the new one, never a mix.
+  bool replace_all(std::string_view mappings) {
+    if (!valid_list(mappings)) return false;
+    std::lock_guard<std::mutex> lock(write_);
+    TableBuilder b;
+    b.add_text(mappings);
+    commit(b);
+    return true;
+  }
+
+  void clear() { replace_all(""); }
+
+  // Copies up to max addresses of the entry matching host into out, in
+  // listed order, and returns how many the entry has; 0 means host is not
+  // overridden.
+  size_t lookup(std::string_view host, HostAddr* out, size_t max) const {
+    char node[1025];
+    if (host.empty() || host.size() >= sizeof(node)) return 0;
+    std::memcpy(node, host.data(), host.size());
+    node[host.size()] = 0;
+
+    Pin pin(*this);
+    const HostEntry* e = pin.image->table.lookup(node);
+    if (!e) return 0;
+    for (uint32_t i = 0; i < e->addr_count && i < max; i++) out[i] = pin.image->table.addr(*e, 0, i);
+    return e->addr_count;
+  }
+
+  // Number of names and rules.
+  size_t size() const {
+    Pin pin(*this);
+    return pin.image->table.size();
+  }
+
+  // Makes the preload library loaded in this process answer from this
+  // table, now and after every later change here. False if there is no
+  // preload library (or it predates this API).
+  bool install() {
+    using InstallFn = int (*)(const void*, size_t);
+    InstallFn fn = (InstallFn)dlsym(RTLD_DEFAULT, "overridehosts_install_image");
+    if (!fn) return false;
+    std::lock_guard<std::mutex> lock(write_);
+    install_ = fn;
+    const Image* img = current_.load();
+    return install_(img->bytes.data(), img->bytes.size()) == 0;
+  }
+
+ private:
+  static constexpr unsigned kStripes = 16;
+
+  struct Image {
+    std::vector<char> bytes;
+    Table table;
+    explicit Image(std::vector<char> b) : bytes(std::move(b)), table(bytes.data()) {}
+  };
+
+  struct alignas(64) ReaderCount {
+    std::atomic<long> n{0};
+  };
+
+  struct Pin {
+    const Image* image;
+    std::atomic<long>* count;
+    explicit Pin(const HostOverrideTable& t) {
+      count = &t.readers_[t.epoch_.load() & 1][stripe()].n;
+      count->fetch_add(1);
+      image = t.current_.load();
+    }
+    ~Pin() { count->fetch_sub(1, std::memory_order_release); }
+  };
+
+  static unsigned stripe() {
+    static std::atomic<unsigned> next{0};
+    static thread_local unsigned s = next.fetch_add(1, std::memory_order_relaxed) % kStripes;
+    return s;
+  }
+
+  static bool valid_list(std::string_view mappings) {
+    bool bad = false;
+    size_t skipped = for_each_mapping(mappings, [&](std::string_view, const Mapping& m) {
+      bad |= !valid_host(m.host) || !valid_addr_list(m.addrs);
+    });
+    return !bad && !skipped;
+  }
+
+  void drain(unsigned epoch) const {
+    for (;;) {
+      long n = 0;
+      for (const ReaderCount& c : readers_[epoch & 1]) n += c.n.load();
+      if (n == 0) return;
+      sched_yield();
+    }
+  }
+
+  // Caller holds write_.
+  void commit(TableBuilder& b) {
+    std::string canonical = b.encode_canonical();
+    Image* img = new Image(b.finish());
+    canonical_ = std::move(canonical);
+    const Image* old = current_.exchange(img);
+    if (install_) install_(img->bytes.data(), img->bytes.size());
+    drain(epoch_.fetch_add(1));
+    drain(epoch_.fetch_add(1));
+    delete old;
+  }
+
+  std::atomic<const Image*> current_{nullptr};
+  mutable std::atomic<unsigned> epoch_{0};
+  mutable ReaderCount readers_[2][kStripes];
+  std::mutex write_;
+  std::string canonical_;  // current contents, to rebuild from
+  int (*install_)(const void*, size_t) = nullptr;
+};
+
+}  // namespace overridehosts
+
+#endif  // __cplusplus
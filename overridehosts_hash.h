@@ -0,0 +1,144 @@
+// overridehosts_hash.h
+//
+// Case-folded name hash used by the table, in one pass that also finds
+// the length of a NUL-terminated name.
+//
+// The name is folded to ASCII lower case, zero-padded to 16-byte blocks
+// and each block is mixed in as two 64-bit words; the length goes into the
+// finalizer. hash_name() is the byte-at-a-time definition (used where the
+// length is known, e.g. building a table); hash_cstr() computes the same
+// value from a C string sixteen bytes at a time with SSE2 or NEON, which
+// are baseline on x86-64 and AArch64, so the choice is made at compile
+// time and the lookup path has no indirect call. Other targets, and
+// sanitizer builds (the vector loads read past the NUL, never past its
+// page), use the portable loop.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "overridehosts_parse.h"
+
+#if !defined(OVERRIDEHOSTS_SCALAR_HASH) && (defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__))
+#define OVERRIDEHOSTS_SCALAR_HASH 1
+#endif
+#if defined(__has_feature)
+#if !defined(OVERRIDEHOSTS_SCALAR_HASH) && (__has_feature(address_sanitizer) || __has_feature(memory_sanitizer))
+#define OVERRIDEHOSTS_SCALAR_HASH 1
+#endif
+#endif
+
+#if !defined(OVERRIDEHOSTS_SCALAR_HASH) && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define OVERRIDEHOSTS_HASH_SSE2 1
+#elif !defined(OVERRIDEHOSTS_SCALAR_HASH) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define OVERRIDEHOSTS_HASH_NEON 1
+#endif
+
+namespace overridehosts {
+
+inline uint64_t hash_block(uint64_t h, uint64_t lo, uint64_t hi) {
+  h = (h ^ lo) * 0x9e3779b97f4a7c15ull;
+  h = (h ^ (h >> 29) ^ hi) * 0xbf58476d1ce4e5b9ull;
+  return h ^ (h >> 32);
+}
+
+inline uint32_t hash_finish(uint64_t h, size_t len) {
+  h ^= (uint64_t)len * 0x94d049bb133111ebull;
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ull;
+  h ^= h >> 29;
+  return (uint32_t)(h >> 32);
+}
+
+constexpr uint64_t kHashSeed = 0x243f6a8885a308d3ull;
+
+inline uint64_t hash_load(const unsigned char* b) {
+  uint64_t v;
+  std::memcpy(&v, b, sizeof(v));
+  return v;
+}
+
+inline uint32_t hash_name(std::string_view s) {
+  uint64_t h = kHashSeed;
+  for (size_t off = 0; off < s.size(); off += 16) {
+    unsigned char b[16] = {};
+    size_t n = s.size() - off < 16 ? s.size() - off : 16;
+    for (size_t i = 0; i < n; i++) b[i] = (unsigned char)fold(s[off + i]);
+    h = hash_block(h, hash_load(b), hash_load(b + 8));
+  }
+  return hash_finish(h, s.size());
+}
+
+#if defined(OVERRIDEHOSTS_HASH_SSE2) || defined(OVERRIDEHOSTS_HASH_NEON)
+
+// True if a 16-byte load at p would cross into the next page.
+inline bool hash_near_page_end(const char* p) { return ((uintptr_t)p & 4095) > 4096 - 16; }
+
+inline uint32_t hash_cstr(const char* s, size_t& len) {
+  uint64_t h = kHashSeed;
+  for (size_t off = 0;; off += 16) {
+    const char* p = s + off;
+    unsigned char tmp[16];
+    if (hash_near_page_end(p)) {
+      size_t i = 0;
+      for (; i < 16 && p[i]; i++) tmp[i] = (unsigned char)p[i];
+      std::memset(tmp + i, 0, 16 - i);
+      p = (const char*)tmp;
+    }
+#if defined(OVERRIDEHOSTS_HASH_SSE2)
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    unsigned zeros = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    unsigned n = zeros ? (unsigned)__builtin_ctz(zeros) : 16;
+    if (n == 0) {
+      len = off;
+      return hash_finish(h, off);
+    }
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    v = _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+    if (n < 16) {
+      const __m128i idx = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+      v = _mm_and_si128(v, _mm_cmplt_epi8(idx, _mm_set1_epi8((char)n)));
+    }
+    uint64_t lo = (uint64_t)_mm_cvtsi128_si64(v);
+    uint64_t hi = (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v));
+#else
+    uint8x16_t v = vld1q_u8((const uint8_t*)p);
+    uint8x16_t z = vceqq_u8(v, vdupq_n_u8(0));
+    uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(z), 4)), 0);
+    unsigned n = nibbles ? (unsigned)__builtin_ctzll(nibbles) / 4 : 16;
+    if (n == 0) {
+      len = off;
+      return hash_finish(h, off);
+    }
+    uint8x16_t upper = vandq_u8(vcgeq_u8(v, vdupq_n_u8('A')), vcleq_u8(v, vdupq_n_u8('Z')));
+    v = vorrq_u8(v, vandq_u8(upper, vdupq_n_u8(0x20)));
+    if (n < 16) {
+      static const uint8_t kIdx[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+      v = vandq_u8(v, vcltq_u8(vld1q_u8(kIdx), vdupq_n_u8((uint8_t)n)));
+    }
+    uint64_t lo = vgetq_lane_u64(vreinterpretq_u64_u8(v), 0);
+    uint64_t hi = vgetq_lane_u64(vreinterpretq_u64_u8(v), 1);
+#endif
+    h = hash_block(h, lo, hi);
+    if (n < 16) {
+      len = off + n;
+      return hash_finish(h, len);
+    }
+  }
+}
+
+#else
+
+inline uint32_t hash_cstr(const char* s, size_t& len) {
+  len = std::strlen(s);
+  return hash_name(std::string_view(s, len));
+}
+
+#endif
+
+}  // namespace overridehosts
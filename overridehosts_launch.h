@@ -0,0 +1,251 @@
+// overridehosts_launch.h
+//
+// Starting a command under the override, shared by the wrapper, its fork
+// server and overridehosts_spawn(): finding the command, picking the
+// preload library for it and building its environment.
+//
+// The preload library must match the C library of the program being
+// started, not of the host: that is the PT_INTERP of the target's ELF
+// (following "#!" lines). Results for ELF files are kept in a small
+// direct-mapped file under the user's cache directory, keyed on
+// path + device + inode + mtime, so repeated launches of the same tool
+// cost one stat and one pread.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "overridehosts_parse.h"
+#include "overridehosts_table.h"
+
+namespace overridehosts {
+
+enum class Libc : uint32_t { kUnknown = 0, kGlibc = 1, kMusl = 2 };
+
+// The same search execvp() does: names with a '/' are used as is, an
+// empty PATH element means the current directory. Empty if a bare name is
+// not found, where execvp() fails with ENOENT.
+inline std::string resolve_command(const std::string& name) {
+  if (name.empty() || name.find('/') != std::string::npos) return name;
+  const char* path = std::getenv("PATH");
+  std::string_view rest = path ? path : "/bin:/usr/bin";
+  while (true) {
+    size_t colon = rest.find(':');
+    std::string_view dir = rest.substr(0, colon);
+    std::string cand = dir.empty() ? name : std::string(dir) + "/" + name;
+    struct stat st;
+    if (::stat(cand.c_str(), &st) == 0 && S_ISREG(st.st_mode) && ::access(cand.c_str(), X_OK) == 0)
+      return cand;
+    if (colon == std::string_view::npos) return {};
+    rest.remove_prefix(colon + 1);
+  }
+}
+
+inline Libc libc_of_interp(std::string_view interp) {
+  size_t slash = interp.find_last_of('/');
+  std::string_view base = slash == std::string_view::npos ? interp : interp.substr(slash + 1);
+  if (base.substr(0, 8) == "ld-musl-") return Libc::kMusl;
+  if (base.substr(0, 8) == "ld-linux" || base.substr(0, 7) == "ld64.so" || base.substr(0, 5) == "ld.so")
+    return Libc::kGlibc;
+  return Libc::kUnknown;
+}
+
+template <typename Ehdr, typename Phdr>
+inline Libc elf_libc(int fd, const unsigned char* head, size_t n) {
+  if (n < sizeof(Ehdr)) return Libc::kUnknown;
+  Ehdr eh;
+  std::memcpy(&eh, head, sizeof(eh));
+  if (eh.e_phentsize != sizeof(Phdr) || eh.e_phnum == 0 || eh.e_phnum > 256) return Libc::kUnknown;
+
+  std::vector<Phdr> ph(eh.e_phnum);
+  size_t bytes = sizeof(Phdr) * ph.size();
+  if (::pread(fd, ph.data(), bytes, (off_t)eh.e_phoff) != (ssize_t)bytes) return Libc::kUnknown;
+  for (const Phdr& p : ph) {
+    if (p.p_type != PT_INTERP) continue;
+    char interp[PATH_MAX];
+    if (p.p_filesz == 0 || p.p_filesz > sizeof(interp)) return Libc::kUnknown;
+    if (::pread(fd, interp, p.p_filesz, (off_t)p.p_offset) != (ssize_t)p.p_filesz) return Libc::kUnknown;
+    return libc_of_interp(std::string_view(interp, strnlen(interp, p.p_filesz)));
+  }
+  return Libc::kUnknown;  // static: LD_PRELOAD does not apply anyway
+}
+
+struct LibcCacheEntry {
+  uint64_t path_hash;
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint32_t libc;
+  uint32_t check;  // low half of text_hash over the fields above
+};
+
+constexpr size_t kLibcCacheSlots = 256;
+
+inline uint32_t libc_cache_check(const LibcCacheEntry& e) {
+  return (uint32_t)text_hash(std::string_view((const char*)&e, offsetof(LibcCacheEntry, check)));
+}
+
+inline int open_libc_cache() {
+  std::string dir;
+  if (const char* x = std::getenv("XDG_CACHE_HOME"); x && *x) dir = x;
+  else if (const char* h = std::getenv("HOME"); h && *h) {
+    dir = std::string(h) + "/.cache";
+    ::mkdir(dir.c_str(), 0700);
+  } else {
+    return -1;
+  }
+  return ::open((dir + "/overridehosts-libc").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+}
+
+inline Libc libc_of_file(const std::string& path, int depth);
+
+// "#!interp [arg]": the libc that matters is the interpreter's, and for
+// "#!/usr/bin/env prog" the one of prog found through PATH.
+inline Libc shebang_libc(const unsigned char* head, size_t n, int depth) {
+  std::string_view line((const char*)head + 2, n - 2);
+  line = line.substr(0, line.find('\n'));
+  line = trim(line);
+  size_t sp = line.find_first_of(" \t");
+  std::string interp(line.substr(0, sp));
+  if (interp.empty()) return Libc::kUnknown;
+
+  size_t slash = interp.find_last_of('/');
+  if (interp.compare(slash == std::string::npos ? 0 : slash + 1, std::string::npos, "env") == 0 &&
+      sp != std::string_view::npos) {
+    std::string_view args = trim(line.substr(sp));
+    if (!args.empty() && args[0] != '-') {
+      std::string prog(args.substr(0, args.find_first_of(" \t")));
+      Libc l = libc_of_file(resolve_command(prog), depth + 1);
+      if (l != Libc::kUnknown) return l;
+    }
+  }
+  return libc_of_file(interp, depth + 1);
+}
+
+inline Libc libc_of_file(const std::string& path, int depth) {
+  if (depth > 4) return Libc::kUnknown;  // the kernel's own limit
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return Libc::kUnknown;
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    ::close(fd);
+    return Libc::kUnknown;
+  }
+
+  LibcCacheEntry key = {};
+  key.path_hash = text_hash(path);
+  key.dev = (uint64_t)st.st_dev;
+  key.ino = (uint64_t)st.st_ino;
+  key.mtime_sec = (int64_t)st.st_mtim.tv_sec;
+  key.mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+  off_t slot = (off_t)((key.path_hash % kLibcCacheSlots) * sizeof(LibcCacheEntry));
+  int cache = depth == 0 ? open_libc_cache() : -1;
+  if (cache >= 0) {
+    LibcCacheEntry e;
+    if (::pread(cache, &e, sizeof(e), slot) == (ssize_t)sizeof(e) && e.check == libc_cache_check(e) &&
+        std::memcmp(&e, &key, offsetof(LibcCacheEntry, libc)) == 0) {
+      ::close(cache);
+      ::close(fd);
+      return (Libc)e.libc;
+    }
+  }
+
+  unsigned char head[256];
+  ssize_t n = ::pread(fd, head, sizeof(head), 0);
+  Libc l = Libc::kUnknown;
+  bool elf = n >= EI_NIDENT && std::memcmp(head, ELFMAG, SELFMAG) == 0;
+  if (elf && head[EI_DATA] == (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? ELFDATA2LSB : ELFDATA2MSB)) {
+    if (head[EI_CLASS] == ELFCLASS64) l = elf_libc<Elf64_Ehdr, Elf64_Phdr>(fd, head, (size_t)n);
+    else if (head[EI_CLASS] == ELFCLASS32) l = elf_libc<Elf32_Ehdr, Elf32_Phdr>(fd, head, (size_t)n);
+  } else if (n > 2 && head[0] == '#' && head[1] == '!') {
+    l = shebang_libc(head, (size_t)n, depth);
+  }
+  ::close(fd);
+
+  // Scripts are not cached: their answer depends on files we did not stat.
+  if (cache >= 0) {
+    if (elf) {
+      key.libc = (uint32_t)l;
+      key.check = libc_cache_check(key);
+      (void)!::pwrite(cache, &key, sizeof(key), slot);
+    }
+    ::close(cache);
+  }
+  return l;
+}
+
+inline std::string select_preload_so(const std::string& exe_dir, const std::string& target) {
+  if (const char* p = std::getenv("OVERRIDEHOSTS_SO"); p && *p)
+    return std::string(p);
+
+  // Targets we cannot classify (static, foreign, unreadable) get the
+  // variant matching this wrapper's own build.
+  Libc l = libc_of_file(target, 0);
+  if (l == Libc::kUnknown) {
+#if defined(__GLIBC__)
+    l = Libc::kGlibc;
+#else
+    l = Libc::kMusl;
+#endif
+  }
+  return exe_dir + (l == Libc::kMusl
+    ? "/liboverridehosts-musl.so"
+    : "/liboverridehosts-glibc.so");
+}
+
+// execve() rejects any single env string longer than this (MAX_ARG_STRLEN).
+constexpr size_t kMaxEnvBytes = 128 * 1024;
+
+// envp for an overridden child without copying the parent's environment:
+// unchanged entries point into base, only LD_PRELOAD (so_path prepended
+// to any existing value) and the entries in set are new. A null value in
+// set drops the key.
+struct ChildEnv {
+  std::vector<std::string> owned;
+  std::vector<char*> envp;
+};
+
+struct EnvSet {
+  std::string_view key;
+  const std::string* value;
+};
+
+inline void build_child_env(ChildEnv& out, char* const* base, const std::string& so_path,
+                            const std::vector<EnvSet>& set) {
+  out.owned.clear();
+  out.envp.clear();
+  std::string preload = "LD_PRELOAD=" + so_path;
+  for (char* const* p = base; p && *p; p++) {
+    std::string_view e(*p);
+    std::string_view key = e.substr(0, e.find('='));
+    if (key == "LD_PRELOAD") {
+      if (e.size() > key.size() + 1) preload += " " + std::string(e.substr(key.size() + 1));
+      continue;
+    }
+    bool replaced = false;
+    for (const EnvSet& s : set) replaced |= s.key == key;
+    if (!replaced) out.envp.push_back(*p);
+  }
+
+  out.owned.reserve(set.size() + 1);
+  out.owned.push_back(std::move(preload));
+  for (const EnvSet& s : set)
+    if (s.value) out.owned.push_back(std::string(s.key) + "=" + *s.value);
+  for (std::string& o : out.owned) out.envp.push_back(&o[0]);
+  out.envp.push_back(nullptr);
+}
+
+}  // namespace overridehosts
@@ -0,0 +1,74 @@
+// overridehosts_parse.h
+//
+// Mapping-list tokenizer shared by the wrapper and the preload library, so
+// both agree on what a list looks like.
+//
+//   list     := item (sep+ item)*
+//   sep      := ',' | whitespace
+//   item     := host ':' addrs
+//
+// host is everything before the first ':' (so bare IPv6 after it needs no
+// brackets), must be non-empty and must not start with '-' (that is an
+// option to the wrapper). addrs is the non-empty rest; its syntax
+// ("ip[*weight]|...") is checked by TableBuilder. One pass, no copies:
+// every piece is a view into the input.
+
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+namespace overridehosts {
+
+inline char fold(char c) {
+  return (c >= 'A' && c <= 'Z') ? (char)(c + ('a' - 'A')) : c;
+}
+
+inline bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+inline std::string_view trim(std::string_view s) {
+  while (!s.empty() && is_space(s.front())) s.remove_prefix(1);
+  while (!s.empty() && is_space(s.back())) s.remove_suffix(1);
+  return s;
+}
+
+inline bool is_list_sep(char c) { return c == ',' || is_space(c); }
+
+struct Mapping {
+  std::string_view host;
+  std::string_view addrs;
+};
+
+// Splits one item; false if it is not "host:addrs".
+inline bool split_mapping(std::string_view item, Mapping& out) {
+  size_t c = item.find(':');
+  if (c == std::string_view::npos || c == 0 || c + 1 >= item.size() || item[0] == '-') return false;
+  out.host = item.substr(0, c);
+  out.addrs = item.substr(c + 1);
+  return true;
+}
+
+// Calls fn(item, mapping) for every well-formed item in order and returns
+// how many malformed ones were skipped.
+template <typename Fn>
+inline size_t for_each_mapping(std::string_view text, Fn&& fn) {
+  size_t skipped = 0;
+  const char* p = text.data();
+  const char* end = p + text.size();
+  while (p < end) {
+    while (p < end && is_list_sep(*p)) p++;
+    const char* start = p;
+    while (p < end && !is_list_sep(*p)) p++;
+    if (p == start) break;
+
+    std::string_view item(start, (size_t)(p - start));
+    Mapping m;
+    if (split_mapping(item, m)) fn(item, m);
+    else skipped++;
+  }
+  return skipped;
+}
+
+}  // namespace overridehosts
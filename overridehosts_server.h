@@ -0,0 +1,40 @@
+// overridehosts_server.h
+//
+// Wire format of `overridehosts --server <socket>`: a long-running wrapper
+// that keeps the table built and spawns commands on request, so harnesses
+// that start many short processes skip one wrapper exec per child.
+// `overridehosts --client` speaks it; so can anything else.
+//
+// A connection carries one spawn:
+//
+//   client -> server  SpawnRequest, sent with SCM_RIGHTS carrying exactly
+//                     three fds (the child's stdin, stdout, stderr), then
+//                     `bytes` bytes of NUL-terminated strings:
+//                     path, cwd, argv[0..argc), envp[0..envc)
+//   server -> client  int32 pid of the child, or -errno if it did not start
+//   server -> client  int32 wait status once the child has exited
+//
+// path must be absolute (the client does the PATH search); envp is the
+// environment the child would have had without the wrapper, the server
+// adds LD_PRELOAD and the table. All integers are in host byte order.
+//
+// The socket is created mode 0600 and the server closes connections from
+// any other uid than its own (SO_PEERCRED) without reading them.
+
+#pragma once
+
+#include <cstdint>
+
+namespace overridehosts {
+
+constexpr char kSpawnMagic[4] = {'O', 'V', 'S', '1'};
+constexpr uint32_t kSpawnMaxBytes = 16u << 20;
+
+struct SpawnRequest {
+  char magic[4];
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t bytes;
+};
+
+}  // namespace overridehosts
@@ -0,0 +1,69 @@
+// overridehosts_spawn.cpp
+//
+// overridehosts_spawn(): the wrapper's launch path as a function, see
+// overridehosts.h. Mappings travel in canonical form only; there is no
+// memfd here because it would leak into every other child of the caller.
+
+#include <cerrno>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <limits.h>
+#include <spawn.h>
+#include <unistd.h>
+
+#include "overridehosts.h"
+#include "overridehosts_launch.h"
+#include "overridehosts_parse.h"
+#include "overridehosts_table.h"
+
+static std::string self_dir() {
+  char buf[PATH_MAX];
+  ssize_t n = ::readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+  if (n <= 0) return ".";
+  std::string full(buf, (size_t)n);
+  auto pos = full.find_last_of('/');
+  return (pos == std::string::npos) ? "." : full.substr(0, pos);
+}
+
+// Validates like the wrapper does and returns the canonical form.
+static int canonicalize(const char* mappings, std::string& out) {
+  bool bad = false;
+  size_t skipped = overridehosts::for_each_mapping(mappings, [&](std::string_view, const overridehosts::Mapping& m) {
+    bad |= !overridehosts::valid_host(m.host) || !overridehosts::valid_addr_list(m.addrs);
+  });
+  if (bad || skipped) return EINVAL;
+  overridehosts::TableBuilder builder;
+  builder.add_text(mappings);
+  out = builder.encode_canonical();
+  return out.size() + sizeof("OVERRIDEHOSTS=") <= overridehosts::kMaxEnvBytes ? 0 : E2BIG;
+}
+
+extern "C" int overridehosts_spawn(pid_t* pid, const char* file, const posix_spawn_file_actions_t* file_actions,
+                                   const posix_spawnattr_t* attr, char* const argv[], char* const envp[],
+                                   const char* mappings) {
+  if (!file || !argv) return EINVAL;
+  try {
+    std::string canonical;
+    std::vector<overridehosts::EnvSet> set;
+    if (mappings) {
+      if (int rc = canonicalize(mappings, canonical)) return rc;
+      // A table fd inherited from an outer wrapper describes other mappings.
+      set.push_back({"OVERRIDEHOSTS", &canonical});
+      set.push_back({"OVERRIDEHOSTS_FD", nullptr});
+    }
+
+    std::string cmd = overridehosts::resolve_command(file);
+    if (cmd.empty()) return ENOENT;
+    std::string so_path = overridehosts::select_preload_so(self_dir(), cmd);
+    if (::access(so_path.c_str(), R_OK) != 0) return ENOENT;
+
+    overridehosts::ChildEnv env;
+    overridehosts::build_child_env(env, envp ? envp : environ, so_path, set);
+    return ::posix_spawn(pid, cmd.c_str(), file_actions, attr, argv, env.envp.data());
+  } catch (const std::bad_alloc&) {
+    return ENOMEM;
+  }
+}
@@ -0,0 +1,740 @@
+// overridehosts_table.h
+//
+// Compiled override table shared by the wrapper and the preload library.
+//
+// A table is one flat, position-independent image: a header followed by
+// 8-byte aligned sections that refer to each other by index only. The
+// library builds it on the heap from OVERRIDEHOSTS, or maps a file written
+// by `overridehosts --compile` and uses it in place, so large tables cost
+// nothing to load and their pages are shared between processes.
+//
+// Sections:
+//   entries  HostEntry[entry_count]; exact names first, then suffix rules
+//   slots    uint32_t[slot_count]; open addressing, entry index + 1, 0 = empty
+//   addrs    HostAddr[addr_count]; already parsed
+//   sched    uint16_t[sched_count]; weighted round-robin order per entry
+//   trie     TrieNode[trie_count]; reversed-label trie of suffix rules
+//   names    folded host names and trie labels
+//
+// The image is native-endian and meant for the machine that built it.
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "overridehosts_hash.h"
+#include "overridehosts_parse.h"
+
+namespace overridehosts {
+
+constexpr char kImageMagic[8] = {'O', 'V', 'H', 'O', 'S', 'T', 'S', '\0'};
+constexpr uint32_t kImageVersion = 2;  // 2: hash_name() replaced FNV-1a
+constexpr uint32_t kMaxWeight = 100;
+constexpr uint32_t kMaxAddrsPerHost = 64;
+constexpr uint32_t kBloomBits = 8192;
+
+struct HostAddr {
+  int32_t family;
+  union {
+    in_addr v4;
+    in6_addr v6;
+  };
+};
+
+struct HostEntry {
+  uint32_t name_off;
+  uint32_t name_len;
+  uint32_t hash;
+  uint32_t addr_first;
+  uint32_t addr_count;
+  uint32_t sched_first;
+  uint32_t sched_count;  // 0: every address has weight 1
+};
+
+// "*.example.com" matches names below example.com; ".example.com" matches
+// example.com itself as well. Each node's children are contiguous and
+// sorted by label so a step is a binary search.
+struct TrieNode {
+  uint32_t label_off;
+  uint32_t label_len;
+  uint32_t first_child;
+  uint32_t child_count;
+  uint32_t self_entry;  // entry index + 1 for names equal to this suffix, 0 = none
+  uint32_t sub_entry;   // entry index + 1 for names below it, 0 = none
+};
+
+struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t size;
+
+  uint32_t entry_count;
+  uint32_t slot_count;  // power of two
+  uint32_t addr_count;
+  uint32_t sched_count;
+  uint32_t trie_count;  // 0 without suffix rules
+  uint32_t names_size;
+
+  uint64_t entries_off;
+  uint64_t slots_off;
+  uint64_t addrs_off;
+  uint64_t sched_off;
+  uint64_t trie_off;
+  uint64_t names_off;
+
+  // Negative filter: most names a process resolves are not overridden, so
+  // reject them on the folded first byte, the length and two bloom bits
+  // before touching the (possibly cold) slot array. Suffix rules are
+  // filtered on their last byte instead.
+  uint64_t first_bits[4];
+  uint64_t len_bits;
+  uint64_t last_bits[4];
+  uint64_t bloom[kBloomBits / 64];
+};
+
+inline bool bit_test(const uint64_t* bits, uint32_t i) { return (bits[i >> 6] >> (i & 63)) & 1; }
+inline void bit_set(uint64_t* bits, uint32_t i) { bits[i >> 6] |= (uint64_t)1 << (i & 63); }
+
+inline uint32_t len_bit(size_t n) { return n < 63 ? (uint32_t)n : 63; }
+
+// FNV-1a 64 over raw bytes; ties an OVERRIDEHOSTS_FD table to the
+// OVERRIDEHOSTS text it was built from.
+inline uint64_t text_hash(std::string_view s) {
+  uint64_t h = 1469598103934665603ull;
+  for (char c : s) { h ^= (unsigned char)c; h *= 1099511628211ull; }
+  return h;
+}
+
+inline bool parse_addr(std::string_view ip, HostAddr& out) {
+  // If IPv6 is in [..], strip brackets.
+  if (ip.size() >= 3 && ip.front() == '[' && ip.back() == ']') ip = ip.substr(1, ip.size() - 2);
+
+  char buf[INET6_ADDRSTRLEN + 1];
+  if (ip.empty() || ip.size() >= sizeof(buf)) return false;
+  std::memcpy(buf, ip.data(), ip.size());
+  buf[ip.size()] = 0;
+
+  std::memset(&out, 0, sizeof(out));
+  if (inet_pton(AF_INET, buf, &out.v4) == 1) { out.family = AF_INET; return true; }
+  if (inet_pton(AF_INET6, buf, &out.v6) == 1) { out.family = AF_INET6; return true; }
+  return false;
+}
+
+// Read-only view over an image. A default-constructed Table is empty and
+// rejects every name.
+struct Table {
+  const ImageHeader* h;
+  const HostEntry* entries;
+  const uint32_t* slots;
+  const HostAddr* addrs;
+  const uint16_t* sched;
+  const TrieNode* trie;
+  const char* names;
+
+  Table() : Table(&empty_header()) {}
+
+  explicit Table(const void* image)
+      : h((const ImageHeader*)image),
+        entries((const HostEntry*)((const char*)image + h->entries_off)),
+        slots((const uint32_t*)((const char*)image + h->slots_off)),
+        addrs((const HostAddr*)((const char*)image + h->addrs_off)),
+        sched((const uint16_t*)((const char*)image + h->sched_off)),
+        trie((const TrieNode*)((const char*)image + h->trie_off)),
+        names((const char*)image + h->names_off) {}
+
+  static const ImageHeader& empty_header() {
+    static const ImageHeader empty{};
+    return empty;
+  }
+
+  // Checks the header and that every section lies inside the image. The
+  // contents are trusted, like any other config file.
+  static bool valid(const void* image, size_t size) {
+    if (size < sizeof(ImageHeader) || ((uintptr_t)image & 7)) return false;
+    const ImageHeader* h = (const ImageHeader*)image;
+    if (std::memcmp(h->magic, kImageMagic, sizeof(kImageMagic)) != 0 || h->version != kImageVersion) return false;
+    if (h->size > size || h->slot_count == 0 || (h->slot_count & (h->slot_count - 1)) ||
+        h->slot_count < h->entry_count)
+      return false;
+    auto in = [&](uint64_t off, uint64_t count, uint64_t elem) {
+      return off % 8 == 0 && off <= h->size && count <= (h->size - off) / elem;
+    };
+    return in(h->entries_off, h->entry_count, sizeof(HostEntry)) &&
+           in(h->slots_off, h->slot_count, sizeof(uint32_t)) &&
+           in(h->addrs_off, h->addr_count, sizeof(HostAddr)) &&
+           in(h->sched_off, h->sched_count, sizeof(uint16_t)) &&
+           in(h->trie_off, h->trie_count, sizeof(TrieNode)) &&
+           in(h->names_off, h->names_size, 1);
+  }
+
+  uint32_t size() const { return h->entry_count; }
+  uint32_t index(const HostEntry* e) const { return (uint32_t)(e - entries); }
+  std::string_view name(const HostEntry& e) const { return std::string_view(names + e.name_off, e.name_len); }
+
+  // i-th address of e in result order, starting at first.
+  const HostAddr& addr(const HostEntry& e, uint32_t first, uint32_t i) const {
+    return addrs[e.addr_first + (first + i) % e.addr_count];
+  }
+
+  const HostEntry* lookup(const char* node) const {
+    size_t n = 0;
+    if (const HostEntry* e = lookup_exact(node, n)) return e;
+    if (!h->trie_count) return nullptr;
+    return lookup_suffix(node, n ? n : std::strlen(node));
+  }
+
+  // n is set to strlen(node) unless the first byte already rules it out.
+  const HostEntry* lookup_exact(const char* node, size_t& n) const {
+    if (!bit_test(h->first_bits, (unsigned char)fold(node[0]))) return nullptr;
+
+    uint32_t hash = hash_cstr(node, n);
+    if (!bit_test(&h->len_bits, len_bit(n)) || !bloom_test(hash)) return nullptr;
+
+    uint32_t mask = h->slot_count - 1;
+    for (uint32_t s = hash & mask;; s = (s + 1) & mask) {
+      uint32_t idx = slots[s];
+      if (!idx) return nullptr;
+      const HostEntry& e = entries[idx - 1];
+      if (e.hash != hash || e.name_len != n) continue;
+      const char* key = names + e.name_off;
+      size_t k = 0;
+      while (k < n && key[k] == fold(node[k])) k++;
+      if (k == n) return &e;
+    }
+  }
+
+  const HostEntry* lookup_suffix(const char* node, size_t end) const {
+    if (!bit_test(h->last_bits, (unsigned char)fold(node[end - 1]))) return nullptr;
+
+    uint32_t cur = 0, found = 0;
+    for (;;) {
+      size_t start = end;
+      while (start > 0 && node[start - 1] != '.') start--;
+      if (start == end) return nullptr;  // empty label
+
+      const TrieNode& t = trie[cur];
+      uint32_t lo = t.first_child, hi = t.first_child + t.child_count;
+      while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (label_cmp(trie[mid], node + start, end - start) < 0) lo = mid + 1;
+        else hi = mid;
+      }
+      if (lo == t.first_child + t.child_count || label_cmp(trie[lo], node + start, end - start) != 0) break;
+
+      cur = lo;
+      if (start == 0) {
+        if (trie[cur].self_entry) found = trie[cur].self_entry;
+        break;
+      }
+      if (trie[cur].sub_entry) found = trie[cur].sub_entry;
+      end = start - 1;
+    }
+    return found ? &entries[found - 1] : nullptr;
+  }
+
+  static bool bloom_test(const uint64_t* bloom, uint32_t hash) {
+    return bit_test(bloom, hash % kBloomBits) && bit_test(bloom, (hash >> 13) % kBloomBits);
+  }
+
+ private:
+  bool bloom_test(uint32_t hash) const { return bloom_test(h->bloom, hash); }
+
+  // Compares a stored (folded) label with a label from the query.
+  int label_cmp(const TrieNode& t, const char* q, size_t qn) const {
+    const char* stored = names + t.label_off;
+    size_t n = t.label_len < qn ? t.label_len : qn;
+    for (size_t i = 0; i < n; i++) {
+      unsigned char a = (unsigned char)stored[i], b = (unsigned char)fold(q[i]);
+      if (a != b) return a < b ? -1 : 1;
+    }
+    return t.label_len < qn ? -1 : t.label_len > qn ? 1 : 0;
+  }
+};
+
+// Accumulates mappings and produces an image. Later duplicates win.
+// One "ip[*weight]" item of an address list.
+inline bool parse_addr_item(std::string_view item, HostAddr& a, uint32_t& w) {
+  item = trim(item);
+  w = 1;
+  size_t star = item.find('*');
+  if (star != std::string_view::npos) {
+    std::string_view ws = trim(item.substr(star + 1));
+    item = trim(item.substr(0, star));
+    w = 0;
+    for (char c : ws) {
+      if (c < '0' || c > '9' || w > kMaxWeight) return false;
+      w = w * 10 + (uint32_t)(c - '0');
+    }
+    if (w == 0 || w > kMaxWeight) return false;
+  }
+  return parse_addr(item, a);
+}
+
+// True if every item of "ip[*weight]|..." is valid and there are at most
+// kMaxAddrsPerHost of them. TableBuilder itself skips bad items instead.
+inline bool valid_addr_list(std::string_view list) {
+  uint32_t n = 0;
+  for (;;) {
+    size_t j = list.find('|');
+    HostAddr a;
+    uint32_t w;
+    if (!parse_addr_item(list.substr(0, j), a, w) || ++n > kMaxAddrsPerHost) return false;
+    if (j == std::string_view::npos) return true;
+    list = list.substr(j + 1);
+  }
+}
+
+// For "*.suffix" / ".suffix" returns the suffix, empty if malformed.
+inline std::string_view rule_suffix_of(std::string_view host) {
+  bool include_self = host[0] == '.';
+  if (!include_self && (host.size() < 2 || host[1] != '.')) return {};
+  std::string_view suffix = host.substr(include_self ? 1 : 2);
+  if (suffix.empty() || suffix.find('*') != std::string_view::npos ||
+      suffix.front() == '.' || suffix.back() == '.' || suffix.find("..") != std::string_view::npos)
+    return {};
+  return suffix;
+}
+
+// Up to NI_MAXHOST - 1 bytes, the most a hostent result has room for.
+inline bool valid_host(std::string_view host) {
+  if (host.empty() || host.size() > 1024) return false;
+  if (host[0] == '*' || host[0] == '.') return !rule_suffix_of(host).empty();
+  return host.find('*') == std::string_view::npos;
+}
+
+// --- canonical encoding ---
+// What the wrapper exports in OVERRIDEHOSTS once it has validated and
+// deduplicated the mappings: kCanonicalTag followed by unpadded base64 of
+// a record stream, one record per entry in TableBuilder order
+//   u16 name_len (LE), folded name, u8 addr_count,
+//   addr_count x { u8 family (4 or 6), u8 weight, 4 or 16 address bytes }
+// Loading it skips tokenizing, inet_pton and validation.
+constexpr char kCanonicalTag[] = "ovh1:";
+
+inline bool is_canonical(std::string_view s) {
+  return s.size() >= sizeof(kCanonicalTag) - 1 && s.compare(0, sizeof(kCanonicalTag) - 1, kCanonicalTag) == 0;
+}
+
+inline void base64_append(std::string& out, const unsigned char* p, size_t n) {
+  static const char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  out.reserve(out.size() + (n + 2) / 3 * 4);
+  size_t i = 0;
+  for (; i + 3 <= n; i += 3) {
+    uint32_t v = (uint32_t)p[i] << 16 | (uint32_t)p[i + 1] << 8 | p[i + 2];
+    out += kAlphabet[v >> 18];
+    out += kAlphabet[(v >> 12) & 63];
+    out += kAlphabet[(v >> 6) & 63];
+    out += kAlphabet[v & 63];
+  }
+  if (i < n) {
+    uint32_t v = (uint32_t)p[i] << 16 | (i + 1 < n ? (uint32_t)p[i + 1] << 8 : 0);
+    out += kAlphabet[v >> 18];
+    out += kAlphabet[(v >> 12) & 63];
+    if (i + 1 < n) out += kAlphabet[(v >> 6) & 63];
+  }
+}
+
+inline bool base64_decode(std::string_view in, std::vector<unsigned char>& out) {
+  auto val = [](char c) -> int {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    return c == '+' ? 62 : c == '/' ? 63 : -1;
+  };
+  if (in.size() % 4 == 1) return false;
+  out.clear();
+  out.reserve(in.size() / 4 * 3 + 2);
+  uint32_t acc = 0;
+  int bits = 0;
+  for (char c : in) {
+    int v = val(c);
+    if (v < 0) return false;
+    acc = acc << 6 | (uint32_t)v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out.push_back((unsigned char)(acc >> bits));
+    }
+  }
+  return true;
+}
+
+// Calls fn(name, addrs, weights, n) per record; false on a malformed stream.
+template <typename Fn>
+inline bool for_each_canonical(std::string_view s, Fn&& fn) {
+  if (!is_canonical(s)) return false;
+  std::vector<unsigned char> buf;
+  if (!base64_decode(s.substr(sizeof(kCanonicalTag) - 1), buf)) return false;
+
+  const unsigned char* p = buf.data();
+  const unsigned char* end = p + buf.size();
+  HostAddr addrs[kMaxAddrsPerHost];
+  uint32_t weights[kMaxAddrsPerHost];
+  while (p < end) {
+    if (end - p < 3) return false;
+    size_t len = (size_t)p[0] | (size_t)p[1] << 8;
+    p += 2;
+    if ((size_t)(end - p) < len + 1 || len == 0) return false;
+    std::string_view name((const char*)p, len);
+    p += len;
+    uint32_t n = *p++;
+    if (n == 0 || n > kMaxAddrsPerHost) return false;
+    for (uint32_t i = 0; i < n; i++) {
+      if (end - p < 2) return false;
+      int fam = p[0];
+      weights[i] = p[1];
+      size_t alen = fam == 4 ? sizeof(in_addr) : fam == 6 ? sizeof(in6_addr) : 0;
+      p += 2;
+      if (!alen || (size_t)(end - p) < alen || weights[i] == 0 || weights[i] > kMaxWeight) return false;
+      std::memset(&addrs[i], 0, sizeof(HostAddr));
+      addrs[i].family = fam == 4 ? AF_INET : AF_INET6;
+      std::memcpy(fam == 4 ? (void*)&addrs[i].v4 : (void*)&addrs[i].v6, p, alen);
+      p += alen;
+    }
+    fn(name, addrs, weights, n);
+  }
+  return true;
+}
+
+struct TableBuilder {
+  struct SuffixRule {
+    uint32_t off;  // into names
+    uint32_t len;
+    uint32_t entry;
+    bool include_self;
+  };
+
+  ImageHeader hdr{};
+  std::vector<char> names;
+  std::vector<HostEntry> entries;  // exact names only until finish()
+  std::vector<HostAddr> addrs;
+  std::vector<uint16_t> sched;
+  std::vector<uint32_t> slots;
+  std::vector<HostEntry> rule_entries;
+  std::vector<SuffixRule> rules;
+  std::vector<TrieNode> trie;
+
+  // A mapping list as defined in overridehosts_parse.h; malformed items
+  // are skipped.
+  void add_text(std::string_view all) {
+    for_each_mapping(all, [&](std::string_view, const Mapping& m) { add(m.host, m.addrs); });
+  }
+
+  // host is an exact name, "*.suffix" or ".suffix"; addrs is
+  // "ip[*weight]|ip[*weight]|...". Returns false if nothing was added.
+  bool add(std::string_view host, std::string_view list) {
+    if (host.empty()) return false;
+    if (host[0] == '*' || host[0] == '.') return add_rule(host, list);
+
+    HostEntry e{};
+    e.name_off = (uint32_t)names.size();
+    e.name_len = (uint32_t)host.size();
+    for (char c : host) names.push_back(fold(c));
+    e.hash = hash_name(host);
+    if (!parse_addr_list(list, e)) {
+      names.resize(e.name_off);
+      return false;
+    }
+    insert_entry(e);
+    return true;
+  }
+
+  // Loads a canonical encoding (see kCanonicalTag). False if malformed;
+  // records before the damage are kept.
+  bool add_canonical(std::string_view s) {
+    return for_each_canonical(s, [&](std::string_view host, const HostAddr* a, const uint32_t* w, uint32_t n) {
+      add_parsed(host, a, w, n);
+    });
+  }
+
+  // Same as add() with the address list already parsed.
+  bool add_parsed(std::string_view host, const HostAddr* a, const uint32_t* w, uint32_t n) {
+    if (host.empty() || n == 0) return false;
+    bool rule = host[0] == '*' || host[0] == '.';
+    if (rule && rule_suffix_of(host).empty()) return false;
+
+    HostEntry e{};
+    e.name_off = (uint32_t)names.size();
+    e.name_len = (uint32_t)host.size();
+    for (char c : host) names.push_back(fold(c));
+    set_addrs(e, a, w, n);
+    if (rule) push_rule(host, e);
+    else {
+      e.hash = hash_name(host);
+      insert_entry(e);
+    }
+    return true;
+  }
+
+  // The canonical encoding of everything added so far. Call before finish().
+  std::string encode_canonical() const {
+    std::vector<unsigned char> raw;
+    auto put = [&](const HostEntry& e) {
+      raw.push_back((unsigned char)(e.name_len & 0xff));
+      raw.push_back((unsigned char)(e.name_len >> 8));
+      raw.insert(raw.end(), names.begin() + e.name_off, names.begin() + e.name_off + e.name_len);
+      raw.push_back((unsigned char)e.addr_count);
+      uint32_t weights[kMaxAddrsPerHost];
+      for (uint32_t i = 0; i < e.addr_count; i++) weights[i] = e.sched_count ? 0 : 1;
+      for (uint32_t i = 0; i < e.sched_count; i++) weights[sched[e.sched_first + i]]++;
+      for (uint32_t i = 0; i < e.addr_count; i++) {
+        const HostAddr& a = addrs[e.addr_first + i];
+        const unsigned char* b = a.family == AF_INET ? (const unsigned char*)&a.v4 : (const unsigned char*)&a.v6;
+        raw.push_back(a.family == AF_INET ? 4 : 6);
+        raw.push_back((unsigned char)weights[i]);
+        raw.insert(raw.end(), b, b + (a.family == AF_INET ? sizeof(in_addr) : sizeof(in6_addr)));
+      }
+    };
+    for (const HostEntry& e : entries) put(e);
+    for (const HostEntry& e : rule_entries) put(e);
+
+    std::string out = kCanonicalTag;
+    base64_append(out, raw.data(), raw.size());
+    return out;
+  }
+
+  // Spreads the exact names over more slots, up to max_slots, until every
+  // one sits in its home slot (a perfect hash: a hit is found on the first
+  // probe), else settles on the size with the fewest displaced names.
+  // Returns that number. For tables baked at build time, where memory in
+  // exchange for probes is a good trade.
+  uint32_t spread_slots(uint32_t max_slots) {
+    if (slots.empty()) rehash(8);
+    uint32_t best_cap = (uint32_t)slots.size(), best = UINT32_MAX;
+    for (uint32_t cap = best_cap; cap && cap <= max_slots; cap *= 2) {
+      rehash(cap);
+      uint32_t displaced = 0;
+      for (uint32_t i = 0; i < entries.size(); i++) displaced += slots[entries[i].hash & (cap - 1)] != i + 1;
+      if (displaced < best) {
+        best = displaced;
+        best_cap = cap;
+      }
+      if (displaced == 0) break;
+    }
+    rehash(best_cap);
+    return best;
+  }
+
+  std::vector<char> finish() {
+    build_trie();
+    if (slots.empty()) rehash(8);
+
+    // Suffix rules go after the exact names so slot indices stay valid.
+    uint32_t rule_base = (uint32_t)entries.size();
+    for (TrieNode& t : trie) {
+      if (t.self_entry) t.self_entry += rule_base;
+      if (t.sub_entry) t.sub_entry += rule_base;
+    }
+    entries.insert(entries.end(), rule_entries.begin(), rule_entries.end());
+
+    std::memcpy(hdr.magic, kImageMagic, sizeof(kImageMagic));
+    hdr.version = kImageVersion;
+    hdr.entry_count = (uint32_t)entries.size();
+    hdr.slot_count = (uint32_t)slots.size();
+    hdr.addr_count = (uint32_t)addrs.size();
+    hdr.sched_count = (uint32_t)sched.size();
+    hdr.trie_count = (uint32_t)trie.size();
+    hdr.names_size = (uint32_t)names.size();
+
+    uint64_t off = align8(sizeof(ImageHeader));
+    hdr.entries_off = off; off = align8(off + entries.size() * sizeof(HostEntry));
+    hdr.slots_off = off;   off = align8(off + slots.size() * sizeof(uint32_t));
+    hdr.addrs_off = off;   off = align8(off + addrs.size() * sizeof(HostAddr));
+    hdr.sched_off = off;   off = align8(off + sched.size() * sizeof(uint16_t));
+    hdr.trie_off = off;    off = align8(off + trie.size() * sizeof(TrieNode));
+    hdr.names_off = off;   off = align8(off + names.size());
+    hdr.size = off;
+
+    std::vector<char> image(off, 0);
+    std::memcpy(image.data(), &hdr, sizeof(hdr));
+    copy(image, hdr.entries_off, entries);
+    copy(image, hdr.slots_off, slots);
+    copy(image, hdr.addrs_off, addrs);
+    copy(image, hdr.sched_off, sched);
+    copy(image, hdr.trie_off, trie);
+    copy(image, hdr.names_off, names);
+    return image;
+  }
+
+ private:
+  static uint64_t align8(uint64_t n) { return (n + 7) & ~(uint64_t)7; }
+
+  template <class T>
+  static void copy(std::vector<char>& image, uint64_t off, const std::vector<T>& v) {
+    if (!v.empty()) std::memcpy(image.data() + off, v.data(), v.size() * sizeof(T));
+  }
+
+  // Parses "ip[*weight]|..." into addrs (and sched if any weight is not 1).
+  // Invalid addresses are skipped.
+  bool parse_addr_list(std::string_view list, HostEntry& e) {
+    HostAddr parsed[kMaxAddrsPerHost];
+    uint32_t weights[kMaxAddrsPerHost];
+    uint32_t n = 0;
+    while (!list.empty() && n < kMaxAddrsPerHost) {
+      size_t j = list.find('|');
+      std::string_view item = list.substr(0, j);
+      list = (j == std::string_view::npos) ? std::string_view() : list.substr(j + 1);
+      if (parse_addr_item(item, parsed[n], weights[n])) n++;
+    }
+    if (!n) return false;
+    set_addrs(e, parsed, weights, n);
+    return true;
+  }
+
+  void set_addrs(HostEntry& e, const HostAddr* a, const uint32_t* weights, uint32_t n) {
+    e.addr_first = (uint32_t)addrs.size();
+    e.addr_count = n;
+    e.sched_first = (uint32_t)sched.size();
+    e.sched_count = 0;
+    addrs.insert(addrs.end(), a, a + n);
+
+    bool weighted = false;
+    for (uint32_t i = 0; i < n; i++) weighted |= weights[i] != 1;
+    if (!weighted) return;
+
+    // Smooth weighted round-robin: spreads heavy addresses out instead of
+    // returning them back to back.
+    int32_t cur[kMaxAddrsPerHost] = {};
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < e.addr_count; i++) total += weights[i];
+    for (uint32_t step = 0; step < total; step++) {
+      uint32_t best = 0;
+      for (uint32_t i = 0; i < e.addr_count; i++) {
+        cur[i] += (int32_t)weights[i];
+        if (cur[i] > cur[best]) best = i;
+      }
+      cur[best] -= (int32_t)total;
+      sched.push_back((uint16_t)best);
+    }
+    e.sched_count = total;
+  }
+
+  void rehash(uint32_t cap) {
+    slots.assign(cap, 0);
+    for (uint32_t i = 0; i < entries.size(); i++) {
+      uint32_t s = entries[i].hash & (cap - 1);
+      while (slots[s]) s = (s + 1) & (cap - 1);
+      slots[s] = i + 1;
+    }
+  }
+
+  // Keeps the load factor at or below 1/2.
+  void insert_entry(const HostEntry& e) {
+    if (slots.empty() || (entries.size() + 1) * 2 > slots.size())
+      rehash(slots.empty() ? 8 : (uint32_t)slots.size() * 2);
+
+    uint32_t mask = (uint32_t)slots.size() - 1;
+    std::string_view name(names.data() + e.name_off, e.name_len);
+    uint32_t s = e.hash & mask;
+    for (; slots[s]; s = (s + 1) & mask) {
+      HostEntry& old = entries[slots[s] - 1];
+      if (old.hash == e.hash && std::string_view(names.data() + old.name_off, old.name_len) == name) {
+        uint32_t off = old.name_off;
+        old = e;
+        old.name_off = off;
+        names.resize(e.name_off);
+        return;
+      }
+    }
+    entries.push_back(e);
+    slots[s] = (uint32_t)entries.size();
+
+    bit_set(hdr.first_bits, (unsigned char)name[0]);
+    bit_set(&hdr.len_bits, len_bit(name.size()));
+    bit_set(hdr.bloom, e.hash % kBloomBits);
+    bit_set(hdr.bloom, (e.hash >> 13) % kBloomBits);
+  }
+
+  bool add_rule(std::string_view host, std::string_view list) {
+    if (rule_suffix_of(host).empty()) return false;
+
+    HostEntry e{};
+    e.name_off = (uint32_t)names.size();
+    e.name_len = (uint32_t)host.size();
+    for (char c : host) names.push_back(fold(c));
+    if (!parse_addr_list(list, e)) {
+      names.resize(e.name_off);
+      return false;
+    }
+    push_rule(host, e);
+    return true;
+  }
+
+  void push_rule(std::string_view host, const HostEntry& e) {
+    std::string_view suffix = rule_suffix_of(host);
+    uint32_t off = e.name_off + (uint32_t)(host.size() - suffix.size());
+    rules.push_back({off, (uint32_t)suffix.size(), (uint32_t)rule_entries.size(), host[0] == '.'});
+    rule_entries.push_back(e);
+    bit_set(hdr.last_bits, (unsigned char)fold(suffix.back()));
+  }
+
+  std::string_view rule_suffix(const SuffixRule& r) const {
+    return std::string_view(names.data() + r.off, r.len);
+  }
+
+  // Label d counted from the right (0 = TLD); empty past the leftmost label.
+  static std::string_view label_from_right(std::string_view s, size_t d) {
+    size_t end = s.size();
+    for (;;) {
+      size_t dot = end ? s.rfind('.', end - 1) : std::string_view::npos;
+      size_t start = dot == std::string_view::npos ? 0 : dot + 1;
+      if (d-- == 0) return s.substr(start, end - start);
+      if (start == 0) return std::string_view();
+      end = start - 1;
+    }
+  }
+
+  void build_trie() {
+    if (rules.empty()) return;
+
+    // Stable, so among rules for the same suffix the later one is applied
+    // last; a suffix sorts before the names below it.
+    std::stable_sort(rules.begin(), rules.end(), [this](const SuffixRule& a, const SuffixRule& b) {
+      for (size_t d = 0;; d++) {
+        std::string_view la = label_from_right(rule_suffix(a), d), lb = label_from_right(rule_suffix(b), d);
+        if (la != lb) return la < lb;
+        if (la.empty()) return false;
+      }
+    });
+
+    struct Work {
+      uint32_t node, lo, hi, depth;
+    };
+    std::vector<Work> queue{{0, 0, (uint32_t)rules.size(), 0}};
+    trie.assign(1, TrieNode{});
+
+    // Breadth first, so each node's children are appended back to back.
+    for (size_t qi = 0; qi < queue.size(); qi++) {
+      Work w = queue[qi];
+      uint32_t i = w.lo;
+      for (; i < w.hi && label_from_right(rule_suffix(rules[i]), w.depth).empty(); i++) {
+        trie[w.node].sub_entry = rules[i].entry + 1;
+        if (rules[i].include_self) trie[w.node].self_entry = rules[i].entry + 1;
+      }
+
+      uint32_t first = (uint32_t)trie.size();
+      while (i < w.hi) {
+        std::string_view label = label_from_right(rule_suffix(rules[i]), w.depth);
+        uint32_t j = i + 1;
+        while (j < w.hi && label_from_right(rule_suffix(rules[j]), w.depth) == label) j++;
+        trie.push_back({(uint32_t)(label.data() - names.data()), (uint32_t)label.size(), 0, 0, 0, 0});
+        queue.push_back({(uint32_t)trie.size() - 1, i, j, w.depth + 1});
+        i = j;
+      }
+      trie[w.node].first_child = first;
+      trie[w.node].child_count = (uint32_t)trie.size() - first;
+    }
+  }
+};
+
+}  // namespace overridehosts
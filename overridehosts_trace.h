@@ -0,0 +1,88 @@
+// overridehosts_trace.h
+//
+// Shared-memory trace ring for lookups the library hands to the system
+// resolver, shared by the library (writer) and `overridehosts --trace`
+// (reader).
+//
+// With OVERRIDEHOSTS_TRACE set the library creates a POSIX shared memory
+// object named by trace_shm_name(pid): a TraceHeader followed by a
+// power-of-two array of TraceRecord. Writers claim a sequence number with
+// one fetch_add on head and publish the record through its seq field
+// (odd while being written, 2 * (n + 1) once record n is complete), so
+// writers never wait and a reader simply drops records that were
+// overwritten under it. Every field is an atomic so the reader may race
+// with writers without undefined behaviour.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+namespace overridehosts {
+
+constexpr char kTraceMagic[8] = {'O', 'V', 'T', 'R', 'A', 'C', 'E', '\0'};
+constexpr uint32_t kTraceVersion = 2;  // 2: hash_name() changed
+constexpr uint32_t kTraceDefaultRecords = 4096;
+constexpr uint32_t kTraceMaxRecords = 1u << 20;
+
+struct TraceRecord {
+  std::atomic<uint64_t> seq;
+  std::atomic<uint64_t> wall_ns;      // CLOCK_REALTIME at completion
+  std::atomic<uint64_t> duration_ns;  // time inside the real getaddrinfo
+  std::atomic<uint64_t> hash_rc;      // hash_name(node) << 32 | (uint32_t)rc
+};
+
+struct alignas(64) TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t capacity;  // records, power of two
+  alignas(64) std::atomic<uint64_t> head;  // next sequence number
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "trace ring needs lock-free 64-bit atomics");
+
+inline size_t trace_bytes(uint32_t capacity) {
+  return sizeof(TraceHeader) + sizeof(TraceRecord) * (size_t)capacity;
+}
+
+inline TraceRecord* trace_records(TraceHeader* h) { return (TraceRecord*)(h + 1); }
+
+inline void trace_shm_name(long pid, char* buf, size_t len) {
+  std::snprintf(buf, len, "/overridehosts-trace.%ld", pid);
+}
+
+inline void trace_write(TraceHeader* h, uint64_t wall_ns, uint64_t duration_ns, uint32_t hash, int rc) {
+  uint64_t n = h->head.fetch_add(1, std::memory_order_relaxed);
+  TraceRecord& r = trace_records(h)[n & (h->capacity - 1)];
+  r.seq.store(2 * n + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  r.wall_ns.store(wall_ns, std::memory_order_relaxed);
+  r.duration_ns.store(duration_ns, std::memory_order_relaxed);
+  r.hash_rc.store((uint64_t)hash << 32 | (uint32_t)rc, std::memory_order_relaxed);
+  r.seq.store(2 * n + 2, std::memory_order_release);
+}
+
+struct TraceEntry {
+  uint64_t wall_ns;
+  uint64_t duration_ns;
+  uint32_t hash;
+  int rc;
+};
+
+// Copies record n if it is complete and was not overwritten while read.
+inline bool trace_read(const TraceHeader* h, uint64_t n, TraceEntry& out) {
+  const TraceRecord& r = trace_records((TraceHeader*)h)[n & (h->capacity - 1)];
+  if (r.seq.load(std::memory_order_acquire) != 2 * n + 2) return false;
+  out.wall_ns = r.wall_ns.load(std::memory_order_relaxed);
+  out.duration_ns = r.duration_ns.load(std::memory_order_relaxed);
+  uint64_t hr = r.hash_rc.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (r.seq.load(std::memory_order_relaxed) != 2 * n + 2) return false;
+  out.hash = (uint32_t)(hr >> 32);
+  out.rc = (int)(uint32_t)hr;
+  return true;
+}
+
+}  // namespace overridehosts
@@ -0,0 +1,749 @@
+// resolve_check.cpp
+//
+// Smoke test for liboverridehosts.so and the wrapper, run by `make check`.
+//
+// In-process checks: re-executes itself with the library preloaded and a
+// fixed OVERRIDEHOSTS table, then checks what getaddrinfo() returns for
+//
+//   exact     a listed name, with its addresses in listed order
+//   miss      localhost, which is not in the table and must come from libc
+//   cache     localhost again, answered from OVERRIDEHOSTS_CACHE_TTL
+//   wildcard  *.suffix and .suffix entries, and an exact name beating them
+//   service   numeric and named services, and AI_NUMERICSERV
+//   canon     AI_CANONNAME
+//   ipv6      v6 entries, AF_INET6 vs AF_INET, AI_V4MAPPED and AI_ALL
+//   hostent   gethostbyname*() and the _r variants, ERANGE
+//   reverse   getnameinfo() and gethostbyaddr*() on overridden addresses
+//   gai_a     getaddrinfo_a() with a hit and a miss in one batch
+//   ares      ares_getaddrinfo() and ares_gethostbyname(), when built
+//             with OVERRIDEHOSTS_CHECK_ARES
+//   coalesce  concurrent callers of one miss (OVERRIDEHOSTS_COALESCE)
+//   install   a HostOverrideTable installed into the library, and the
+//             per-thread memo seeing each change to it
+//   fork      a forked child's exit() leaves the parent's trace ring and
+//             OVERRIDEHOSTS_STATS file alone
+//   stats     the dump the in-process stage leaves at exit
+//
+// Out of process:
+//
+//   hash      hash_cstr() against hash_name() for every length up to 300
+//             at every alignment, and up to an unmapped page
+//   spawn     overridehosts_spawn(), and its EINVAL and ENOENT returns
+//   reload    OVERRIDEHOSTS_RELOAD picking up a file renamed into place
+//   baked     a baked library (--baked) ignoring OVERRIDEHOSTS
+//
+// Wrapper checks (with --wrapper): starts itself through the wrapper in
+// --probe mode, which resolves the given names and checks the environment
+// it was started with:
+//
+//   args      a comma-joined list as one argument
+//   memfd     the ovh1: text and a sealed memfd both reach the child
+//   large     a table too big for the environment goes by memfd alone
+//   nested    a wrapper inside a wrapper, the inner mappings winning
+//   changed   OVERRIDEHOSTS rewritten between wrapper and child
+//   server    --server / --client, with a malformed OVERRIDEHOSTS on the
+//             client side that only the server would parse
+//
+// Prints one line per failed check and exits 1 if there was any.
+//
+// Usage:
+//   resolve_check [--lib ./liboverridehosts-glibc.so] [--wrapper ./overridehosts]
+//                 [--baked ./liboverridehosts-check.so]
+//   resolve_check --probe host=addr|env:NAME|!env:NAME|canonical|memfd ...
+//
+// Build:
+//   g++ -O2 -std=c++17 -o resolve_check tests/resolve_check.cpp liboverridehosts-spawn.a -lanl
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits.h>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../overridehosts.h"
+
+#ifdef OVERRIDEHOSTS_CHECK_ARES
+#include <ares.h>
+#endif
+
+static const char* kChildEnv = "OVERRIDEHOSTS_CHECK_CHILD";
+static const char* kTable =
+    "exact.test:10.9.0.1|10.9.0.2 "
+    "*.wild.test:10.9.1.1 "
+    ".dot.test:10.9.2.1 "
+    "pinned.wild.test:10.9.1.9 "
+    "v6.test:[2001:db8::1] "
+    "v4.test:10.9.6.2 "
+    "both.test:10.9.6.1|[2001:db8::6] "
+    "h.test:10.9.11.1|10.9.11.2 "
+    "gai.test:10.9.13.1 "
+    "ares.test:10.9.12.1";
+
+static int g_failures = 0;
+
+static void fail(const std::string& what) {
+  std::cerr << "FAIL " << what << "\n";
+  g_failures++;
+}
+
+struct Answer {
+  int rc = 0;
+  std::vector<std::string> addrs;  // one per entry, as inet_ntop() prints them
+  std::vector<int> ports;
+  std::string canon;
+};
+
+static std::string format_sockaddr(const sockaddr* sa) {
+  char buf[INET6_ADDRSTRLEN] = "?";
+  if (sa->sa_family == AF_INET) ::inet_ntop(AF_INET, &((const sockaddr_in*)sa)->sin_addr, buf, sizeof(buf));
+  else if (sa->sa_family == AF_INET6) ::inet_ntop(AF_INET6, &((const sockaddr_in6*)sa)->sin6_addr, buf, sizeof(buf));
+  return buf;
+}
+
+static void collect(const addrinfo* res, Answer& a) {
+  if (res && res->ai_canonname) a.canon = res->ai_canonname;
+  for (const addrinfo* p = res; p; p = p->ai_next) {
+    a.addrs.push_back(format_sockaddr(p->ai_addr));
+    a.ports.push_back(ntohs(((const sockaddr_in*)p->ai_addr)->sin_port));  // same offset in sockaddr_in6
+  }
+}
+
+static Answer lookup(const char* node, const char* service, int flags = 0, int family = AF_INET) {
+  addrinfo hints{};
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = flags;
+  addrinfo* res = nullptr;
+  Answer a;
+  a.rc = ::getaddrinfo(node, service, &hints, &res);
+  if (a.rc != 0) return a;
+  collect(res, a);
+  ::freeaddrinfo(res);
+  return a;
+}
+
+static std::string join(const std::vector<std::string>& v) {
+  std::string s;
+  for (const std::string& x : v) s += (s.empty() ? "" : ",") + x;
+  return s.empty() ? "(none)" : s;
+}
+
+static void expect_addrs(const char* what, const char* node, const std::vector<std::string>& want,
+                         int flags = 0, int family = AF_INET) {
+  Answer a = lookup(node, nullptr, flags, family);
+  if (a.rc != 0) {
+    fail(std::string(what) + ": " + node + ": " + ::gai_strerror(a.rc));
+    return;
+  }
+  if (a.addrs != want) fail(std::string(what) + ": " + node + ": got " + join(a.addrs) + ", want " + join(want));
+}
+
+static void expect_port(const char* node, const char* service, int flags, int want) {
+  std::string what = std::string("service: ") + node + " " + service;
+  Answer a = lookup(node, service, flags);
+  if (want < 0) {
+    if (a.rc == 0) fail(what + ": resolved, want an error");
+    return;
+  }
+  if (a.rc != 0) {
+    fail(what + ": " + ::gai_strerror(a.rc));
+    return;
+  }
+  for (int p : a.ports) {
+    if (p == want) continue;
+    fail(what + ": got port " + std::to_string(p) + ", want " + std::to_string(want));
+    return;
+  }
+}
+
+static std::string format_hostent(const hostent* h) {
+  std::string s;
+  for (char** a = h->h_addr_list; *a; a++) {
+    char buf[INET6_ADDRSTRLEN];
+    ::inet_ntop(h->h_addrtype, *a, buf, sizeof(buf));
+    s += (s.empty() ? "" : ",") + std::string(buf);
+  }
+  return s.empty() ? "(none)" : s;
+}
+
+static void expect_hostent(const char* what, const hostent* h, const char* name, int af, const char* want) {
+  if (!h) fail(std::string(what) + ": no answer for " + name);
+  else if (h->h_addrtype != af || std::string(h->h_name) != name || format_hostent(h) != want)
+    fail(std::string(what) + ": " + name + ": got " + h->h_name + " " + format_hostent(h) + ", want " + want);
+}
+
+static void check_ipv6() {
+  expect_addrs("ipv6", "v6.test", {"2001:db8::1"}, 0, AF_INET6);
+  expect_addrs("ipv6", "both.test", {"10.9.6.1", "2001:db8::6"}, 0, AF_UNSPEC);
+  Answer a = lookup("v6.test", nullptr, 0, AF_INET);
+  if (a.rc == 0) fail("ipv6: v6.test answered AF_INET with " + join(a.addrs));
+  a = lookup("v4.test", nullptr, 0, AF_INET6);
+  if (a.rc == 0) fail("ipv6: v4.test answered AF_INET6 without AI_V4MAPPED: " + join(a.addrs));
+  expect_addrs("v4mapped", "v4.test", {"::ffff:10.9.6.2"}, AI_V4MAPPED, AF_INET6);
+  expect_addrs("v4mapped", "both.test", {"2001:db8::6"}, AI_V4MAPPED, AF_INET6);
+  expect_addrs("v4mapped", "both.test", {"::ffff:10.9.6.1", "2001:db8::6"}, AI_V4MAPPED | AI_ALL, AF_INET6);
+  expect_hostent("ipv6", ::gethostbyname2("v6.test", AF_INET6), "v6.test", AF_INET6, "2001:db8::1");
+}
+
+static void check_hostent() {
+  expect_hostent("hostent", ::gethostbyname("h.test"), "h.test", AF_INET, "10.9.11.1,10.9.11.2");
+
+  hostent he, *res = nullptr;
+  char buf[1024];
+  int herr = 0;
+  int rc = ::gethostbyname_r("h.test", &he, buf, sizeof(buf), &res, &herr);
+  if (rc != 0) fail("hostent: gethostbyname_r: " + std::string(std::strerror(rc)));
+  else expect_hostent("hostent", res, "h.test", AF_INET, "10.9.11.1,10.9.11.2");
+  rc = ::gethostbyname2_r("v6.test", AF_INET6, &he, buf, sizeof(buf), &res, &herr);
+  if (rc != 0) fail("hostent: gethostbyname2_r: " + std::string(std::strerror(rc)));
+  else expect_hostent("hostent", res, "v6.test", AF_INET6, "2001:db8::1");
+  rc = ::gethostbyname_r("h.test", &he, buf, 8, &res, &herr);
+  if (rc != ERANGE) fail("hostent: gethostbyname_r with 8 bytes: got " + std::to_string(rc) + ", want ERANGE");
+
+  // Reverse lookups answer with the name the address is listed under.
+  sockaddr_in sin{};
+  sin.sin_family = AF_INET;
+  ::inet_pton(AF_INET, "10.9.11.2", &sin.sin_addr);
+  char host[NI_MAXHOST];
+  rc = ::getnameinfo((sockaddr*)&sin, sizeof(sin), host, sizeof(host), nullptr, 0, NI_NAMEREQD);
+  if (rc != 0) fail(std::string("reverse: getnameinfo 10.9.11.2: ") + ::gai_strerror(rc));
+  else if (std::string(host) != "h.test") fail("reverse: getnameinfo 10.9.11.2: got " + std::string(host));
+  sockaddr_in6 sin6{};
+  sin6.sin6_family = AF_INET6;
+  ::inet_pton(AF_INET6, "2001:db8::1", &sin6.sin6_addr);
+  rc = ::getnameinfo((sockaddr*)&sin6, sizeof(sin6), host, sizeof(host), nullptr, 0, NI_NAMEREQD);
+  if (rc != 0) fail(std::string("reverse: getnameinfo 2001:db8::1: ") + ::gai_strerror(rc));
+  else if (std::string(host) != "v6.test") fail("reverse: getnameinfo 2001:db8::1: got " + std::string(host));
+  expect_hostent("reverse", ::gethostbyaddr(&sin.sin_addr, sizeof(sin.sin_addr), AF_INET), "h.test", AF_INET,
+                 "10.9.11.2");
+  rc = ::gethostbyaddr_r(&sin.sin_addr, sizeof(sin.sin_addr), AF_INET, &he, buf, sizeof(buf), &res, &herr);
+  if (rc != 0) fail("reverse: gethostbyaddr_r: " + std::string(std::strerror(rc)));
+  else expect_hostent("reverse", res, "h.test", AF_INET, "10.9.11.2");
+}
+
+// An overridden request is answered at once, a miss on a worker thread.
+static void check_getaddrinfo_a() {
+  addrinfo hints{};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  // A datagram miss, so the stream answer cached earlier is not reused.
+  addrinfo dgram = hints;
+  dgram.ai_socktype = SOCK_DGRAM;
+  gaicb hit{}, miss{};
+  hit.ar_name = "gai.test";
+  hit.ar_request = &hints;
+  miss.ar_name = "localhost";
+  miss.ar_request = &dgram;
+  gaicb* list[2] = {&hit, &miss};
+  int rc = ::getaddrinfo_a(GAI_WAIT, list, 2, nullptr);
+  if (rc != 0) {
+    fail(std::string("getaddrinfo_a: ") + ::gai_strerror(rc));
+    return;
+  }
+  const char* want[2] = {"10.9.13.1", "127.0.0.1"};
+  for (int i = 0; i < 2; i++) {
+    Answer a;
+    if ((a.rc = ::gai_error(list[i])) != 0) {
+      fail(std::string("getaddrinfo_a: ") + list[i]->ar_name + ": " + ::gai_strerror(a.rc));
+      continue;
+    }
+    collect(list[i]->ar_result, a);
+    ::freeaddrinfo(list[i]->ar_result);
+    if (a.addrs != std::vector<std::string>{want[i]})
+      fail(std::string("getaddrinfo_a: ") + list[i]->ar_name + ": got " + join(a.addrs) + ", want " + want[i]);
+  }
+}
+
+#ifdef OVERRIDEHOSTS_CHECK_ARES
+// Overridden c-ares lookups run their callback before returning.
+static void check_ares() {
+  ares_channel ch;
+  if (ares_library_init(ARES_LIB_INIT_ALL) != ARES_SUCCESS || ares_init(&ch) != ARES_SUCCESS) {
+    fail("ares: cannot create a channel");
+    return;
+  }
+  std::string got;
+  ares_addrinfo_hints hints{};
+  hints.ai_family = AF_INET;
+  ares_getaddrinfo(ch, "ares.test", nullptr, &hints, [](void* arg, int status, int, ares_addrinfo* res) {
+    std::string& out = *(std::string*)arg;
+    out = status == ARES_SUCCESS && res->nodes ? format_sockaddr(res->nodes->ai_addr) : "status " + std::to_string(status);
+    if (res) ares_freeaddrinfo(res);
+  }, &got);
+  if (got != "10.9.12.1") fail("ares: ares_getaddrinfo: got " + (got.empty() ? "no callback" : got));
+  got.clear();
+  ares_gethostbyname(ch, "ares.test", AF_INET, [](void* arg, int status, int, hostent* h) {
+    *(std::string*)arg = status == ARES_SUCCESS ? format_hostent(h) : "status " + std::to_string(status);
+  }, &got);
+  if (got != "10.9.12.1") fail("ares: ares_gethostbyname: got " + (got.empty() ? "no callback" : got));
+  ares_destroy(ch);
+  ares_library_cleanup();
+}
+#endif
+
+// Runs fn in a forked child so its lookups stay out of this process's
+// stats and its installed table out of later checks.
+template <typename Fn>
+static void in_child(const char* what, Fn fn) {
+  std::cout.flush();
+  pid_t pid = ::fork();
+  if (pid == 0) {
+    fn();
+    std::cerr.flush();
+    std::_Exit(g_failures ? 1 : 0);
+  }
+  int status = 0;
+  while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  if (WIFSIGNALED(status)) fail(std::string(what) + ": child killed by signal " + std::to_string(WTERMSIG(status)));
+  else if (WEXITSTATUS(status) != 0) fail(std::string(what) + ": child failed");
+}
+
+// Callers of one uncached miss share an answer; each gets its own port.
+static void check_coalesce() {
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+  std::vector<Answer> got(8);
+  for (size_t i = 0; i < got.size(); i++)
+    threads.emplace_back([&, i] {
+      while (!go.load()) std::this_thread::yield();
+      got[i] = lookup("localhost", "4242");
+    });
+  go.store(true);
+  for (std::thread& t : threads) t.join();
+  for (const Answer& a : got) {
+    if (a.rc != 0) fail(std::string("coalesce: ") + ::gai_strerror(a.rc));
+    else if (a.addrs != std::vector<std::string>{"127.0.0.1"} || a.ports != std::vector<int>{4242})
+      fail("coalesce: got " + join(a.addrs) + " port " + std::to_string(a.ports.empty() ? 0 : a.ports[0]));
+  }
+}
+
+// A table installed through overridehosts.h replaces OVERRIDEHOSTS, and
+// every later change to it is seen by the next lookup on the same thread,
+// past the per-thread memo of the last answer.
+static void check_installed() {
+  overridehosts::HostOverrideTable t;
+  if (!t.insert("memo.test:10.9.7.1")) fail("install: insert rejected a valid mapping");
+  if (t.insert("memo2.test:10.9.7.2,bad")) fail("install: insert accepted a malformed list");
+  overridehosts::HostAddr out[4];
+  if (t.size() != 1 || t.lookup("memo.test", out, 4) != 1 || t.lookup("memo2.test", out, 4) != 0)
+    fail("install: table holds the wrong names");
+  if (!t.install()) {
+    fail("install: no preload library");
+    return;
+  }
+  expect_addrs("install", "memo.test", {"10.9.7.1"});
+  expect_addrs("memo", "memo.test", {"10.9.7.1"});
+  t.replace_all("memo.test:10.9.7.3");
+  expect_addrs("memo", "memo.test", {"10.9.7.3"});
+  t.insert("memo2.test:10.9.7.4");
+  expect_addrs("memo", "memo.test", {"10.9.7.3"});
+  expect_addrs("memo", "memo2.test", {"10.9.7.4"});
+  overridehosts::HostAddr a{};
+  a.family = AF_INET;
+  ::inet_pton(AF_INET, "10.9.7.5", &a.v4);
+  t.insert("memo.test", &a, 1);
+  expect_addrs("memo", "memo.test", {"10.9.7.5"});
+  if (t.lookup("memo.test", out, 4) != 1) fail("install: lookup lost memo.test");
+}
+
+static void check_fork() {
+  char ring[64];
+  std::snprintf(ring, sizeof(ring), "/dev/shm/overridehosts-trace.%ld", (long)::getpid());
+  if (::access(ring, F_OK) != 0) {
+    fail(std::string("fork: no trace ring at ") + ring);
+    return;
+  }
+  pid_t pid = ::fork();
+  if (pid == 0) {
+    lookup("localhost", nullptr);
+    std::exit(0);
+  }
+  int status = 0;
+  while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  if (::access(ring, F_OK) != 0) fail("fork: a child's exit() unlinked the parent's trace ring");
+  const char* stats = std::getenv("OVERRIDEHOSTS_STATS");
+  if (stats && ::access(stats, F_OK) == 0) fail("fork: a child's exit() wrote the parent's stats file");
+}
+
+static void run_checks() {
+  expect_addrs("exact", "exact.test", {"10.9.0.1", "10.9.0.2"});
+  expect_addrs("miss", "localhost", {"127.0.0.1"});
+  expect_addrs("cache", "localhost", {"127.0.0.1"});
+  expect_addrs("cache", "localhost", {"127.0.0.1"});
+  expect_addrs("wildcard", "a.wild.test", {"10.9.1.1"});
+  expect_addrs("wildcard", "a.b.wild.test", {"10.9.1.1"});
+  expect_addrs("wildcard", "dot.test", {"10.9.2.1"});
+  expect_addrs("wildcard", "x.dot.test", {"10.9.2.1"});
+  expect_addrs("wildcard", "pinned.wild.test", {"10.9.1.9"});
+
+  expect_port("exact.test", "8080", 0, 8080);
+  expect_port("exact.test", "http", 0, 80);
+  expect_port("exact.test", "http", AI_NUMERICSERV, -1);
+
+  Answer a = lookup("exact.test", nullptr, AI_CANONNAME);
+  if (a.rc != 0) fail(std::string("canon: ") + ::gai_strerror(a.rc));
+  else if (a.canon != "exact.test") fail("canon: got \"" + a.canon + "\", want \"exact.test\"");
+  a = lookup("exact.test", nullptr);
+  if (a.rc == 0 && !a.canon.empty()) fail("canon: set without AI_CANONNAME");
+
+  check_ipv6();
+  check_hostent();
+  check_getaddrinfo_a();
+#ifdef OVERRIDEHOSTS_CHECK_ARES
+  check_ares();
+#endif
+  in_child("coalesce", check_coalesce);
+  in_child("install", check_installed);
+  check_fork();
+}
+
+// --- probe mode ---
+// Runs in a child started by the wrapper; exit status 1 means the child
+// did not get the override it was promised. "canonical" wants the
+// wrapper's ovh1: text in OVERRIDEHOSTS, "memfd" a sealed table fd in
+// OVERRIDEHOSTS_FD.
+
+static int probe(int argc, char** argv) {
+  for (int i = 0; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 4, "env:") == 0) {
+      const char* v = std::getenv(arg.c_str() + 4);
+      if (!v || !*v) fail("probe: " + arg.substr(4) + " is not set");
+    } else if (arg.compare(0, 5, "!env:") == 0) {
+      const char* v = std::getenv(arg.c_str() + 5);
+      if (v && *v) fail("probe: " + arg.substr(5) + " is set");
+    } else if (arg == "canonical") {
+      const char* v = std::getenv("OVERRIDEHOSTS");
+      if (!v || std::strncmp(v, "ovh1:", 5) != 0) fail("probe: OVERRIDEHOSTS is not canonical text");
+    } else if (arg == "memfd") {
+      const char* v = std::getenv("OVERRIDEHOSTS_FD");
+      int fd = v ? std::atoi(v) : -1;
+      int seals = fd > 2 ? ::fcntl(fd, F_GET_SEALS) : -1;
+      if (seals < 0 || !(seals & F_SEAL_WRITE)) fail("probe: OVERRIDEHOSTS_FD does not name a sealed memfd");
+    } else if (size_t eq = arg.find('='); eq != std::string::npos) {
+      std::string host = arg.substr(0, eq);
+      Answer a = lookup(host.c_str(), nullptr);
+      if (a.rc != 0) fail("probe: " + host + ": " + ::gai_strerror(a.rc));
+      else if (a.addrs.empty() || a.addrs[0] != arg.substr(eq + 1))
+        fail("probe: " + host + ": got " + join(a.addrs) + ", want " + arg.substr(eq + 1));
+    } else {
+      fail("probe: bad argument " + arg);
+    }
+  }
+  return g_failures ? 1 : 0;
+}
+
+// --reload: run under OVERRIDEHOSTS_FILE=path and OVERRIDEHOSTS_RELOAD=1
+// with path mapping rl.test to 10.9.9.1; renames a new file into place and
+// waits for the answer to change.
+static int reload(const char* path) {
+  expect_addrs("reload", "rl.test", {"10.9.9.1"});
+  std::string tmp = std::string(path) + ".tmp";
+  std::ofstream(tmp) << "rl.test:10.9.9.2\n";
+  if (::rename(tmp.c_str(), path) != 0) fail("reload: rename: " + std::string(std::strerror(errno)));
+  Answer a;
+  for (int i = 0; i < 500; i++) {
+    a = lookup("rl.test", nullptr);
+    if (a.rc == 0 && a.addrs == std::vector<std::string>{"10.9.9.2"}) return g_failures ? 1 : 0;
+    ::usleep(10000);
+  }
+  fail("reload: rl.test still " + join(a.addrs) + " 5s after the file changed");
+  return 1;
+}
+
+// --- wrapper checks ---
+
+static std::string g_self;
+
+// Starts args with env applied on top of ours (null value: unset).
+static pid_t start(const std::vector<std::string>& args,
+                   const std::vector<std::pair<const char*, const char*>>& env = {}) {
+  pid_t pid = ::fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    for (const auto& e : env) {
+      if (e.second) ::setenv(e.first, e.second, 1);
+      else ::unsetenv(e.first);
+    }
+    std::vector<char*> argp;
+    for (const std::string& a : args) argp.push_back((char*)a.c_str());
+    argp.push_back(nullptr);
+    ::execv(argp[0], argp.data());
+    std::cerr << "resolve_check: exec " << args[0] << ": " << std::strerror(errno) << "\n";
+    std::_Exit(127);
+  }
+  return pid;
+}
+
+// The exit code, or 128 + signal.
+static int finish(pid_t pid) {
+  if (pid < 0) return 127;
+  int status = 0;
+  while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static void expect_run(const char* what, const std::vector<std::string>& args,
+                       const std::vector<std::pair<const char*, const char*>>& env = {}) {
+  int rc = finish(start(args, env));
+  if (rc != 0) fail(std::string(what) + ": exit status " + std::to_string(rc));
+}
+
+static bool wait_listening(const std::string& path) {
+  sockaddr_un sa = {};
+  sa.sun_family = AF_UNIX;
+  std::snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path.c_str());
+  for (int i = 0; i < 500; i++) {
+    int s = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool ok = ::connect(s, (sockaddr*)&sa, sizeof(sa)) == 0;
+    ::close(s);
+    if (ok) return true;
+    ::usleep(10000);
+  }
+  return false;
+}
+
+static void check_server(const std::string& wrapper) {
+  std::string sock = "/tmp/resolve_check." + std::to_string(::getpid()) + ".sock";
+  pid_t server = start({wrapper, "--server", sock, "srv.test:10.9.3.1"});
+  if (!wait_listening(sock)) {
+    fail("server: " + sock + " never accepted a connection");
+  } else {
+    // The caller's OVERRIDEHOSTS_FILE reaches the child; OVERRIDEHOSTS
+    // wins over it there.
+    expect_run("server", {wrapper, "--client", sock, "--", g_self, "--probe", "srv.test=10.9.3.1",
+                          "env:OVERRIDEHOSTS", "env:OVERRIDEHOSTS_FILE", "localhost=127.0.0.1"},
+               {{"OVERRIDEHOSTS_FILE", "/nonexistent/resolve_check.img"}, {"OVERRIDEHOSTS", "not-a-mapping"}});
+  }
+  if (server > 0) ::kill(server, SIGTERM);
+  finish(server);
+}
+
+// The preload library is looked up next to this binary unless
+// OVERRIDEHOSTS_SO says otherwise. An outer wrapper's table fd must not
+// reach the child.
+static void check_spawn(const std::string& lib) {
+  ::setenv("OVERRIDEHOSTS_SO", lib.c_str(), 1);
+  ::setenv("OVERRIDEHOSTS_FD", "99,-", 1);
+  std::vector<std::string> args = {g_self, "--probe", "spawn.test=10.9.4.1", "localhost=127.0.0.1",
+                                   "!env:OVERRIDEHOSTS_FD"};
+  std::vector<char*> argp;
+  for (std::string& a : args) argp.push_back(&a[0]);
+  argp.push_back(nullptr);
+  pid_t pid = -1;
+  int rc = overridehosts_spawn(&pid, g_self.c_str(), nullptr, nullptr, argp.data(), nullptr, "spawn.test:10.9.4.1");
+  if (rc != 0) fail(std::string("spawn: ") + std::strerror(rc));
+  else if ((rc = finish(pid)) != 0) fail("spawn: exit status " + std::to_string(rc));
+
+  rc = overridehosts_spawn(&pid, g_self.c_str(), nullptr, nullptr, argp.data(), nullptr, "spawn.test");
+  if (rc != EINVAL) fail(std::string("spawn: malformed mapping: ") + std::strerror(rc) + ", want EINVAL");
+  rc = overridehosts_spawn(&pid, "resolve-check-no-such-command", nullptr, nullptr, argp.data(), nullptr,
+                           "spawn.test:10.9.4.1");
+  if (rc != ENOENT) fail(std::string("spawn: missing command: ") + std::strerror(rc) + ", want ENOENT");
+  ::unsetenv("OVERRIDEHOSTS_SO");
+  ::unsetenv("OVERRIDEHOSTS_FD");
+}
+
+// A table too big for the environment goes to the child as a memfd only.
+static void check_large(const std::string& wrapper) {
+  std::string list = "/tmp/resolve_check." + std::to_string(::getpid()) + ".list";
+  {
+    std::ofstream out(list);
+    for (int i = 0; i < 20000; i++)
+      out << "big" << i << ".test:10.20." << (i >> 8) << "." << (i & 255) << "\n";
+  }
+  expect_run("large", {wrapper, "@" + list, "--", g_self, "--probe", "big0.test=10.20.0.0",
+                       "big19999.test=10.20.78.31", "!env:OVERRIDEHOSTS", "memfd"});
+  ::unlink(list.c_str());
+}
+
+static void run_wrapper_checks(const std::string& wrapper) {
+  expect_run("args", {wrapper, "a.args.test:10.9.5.1,b.args.test:10.9.5.2", "--", g_self, "--probe",
+                      "a.args.test=10.9.5.1", "b.args.test=10.9.5.2"});
+  expect_run("memfd", {wrapper, "mf.test:10.9.8.1", "--", g_self, "--probe", "mf.test=10.9.8.1", "canonical",
+                       "memfd"});
+  check_large(wrapper);
+  // The inner wrapper adds to the outer table; its own mappings win.
+  expect_run("nested", {wrapper, "outer.test:10.9.8.2", "shared.test:10.9.8.3", "--", wrapper, "inner.test:10.9.8.4",
+                        "shared.test:10.9.8.5", "--", g_self, "--probe", "outer.test=10.9.8.2",
+                        "inner.test=10.9.8.4", "shared.test=10.9.8.5", "canonical", "memfd"});
+  // OVERRIDEHOSTS changed on the way no longer matches the memfd, so the
+  // child must parse the new text instead.
+  expect_run("changed", {wrapper, "a.chg.test:10.9.8.6", "--", "/usr/bin/env", "OVERRIDEHOSTS=b.chg.test:10.9.8.7",
+                         g_self, "--probe", "b.chg.test=10.9.8.7", "memfd"});
+  check_server(wrapper);
+}
+
+// What run_checks() leaves in the dump: exact.test is looked up six
+// times (the AI_NUMERICSERV one fails on the service but still counts as
+// a hit), and localhost three times, the last two from the cache.
+static void check_stats(const std::string& path) {
+  std::ifstream in(path);
+  if (!in) {
+    fail("stats: no dump at " + path);
+    return;
+  }
+  std::vector<std::pair<std::string, std::string>> want = {
+    {"overridehosts_host_hits_total{host=\"exact.test\"}", "6"},
+    {"overridehosts_cache_hits_total", "2"},
+  };
+  std::vector<bool> seen(want.size());
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t sp = line.rfind(' ');
+    if (sp == std::string::npos) continue;
+    for (size_t i = 0; i < want.size(); i++) {
+      if (line.compare(0, sp, want[i].first) != 0) continue;
+      seen[i] = true;
+      if (line.substr(sp + 1) != want[i].second) fail("stats: got \"" + line + "\", want " + want[i].second);
+    }
+  }
+  for (size_t i = 0; i < want.size(); i++)
+    if (!seen[i]) fail("stats: no " + want[i].first);
+}
+
+// hash_cstr() must agree with hash_name() for every length and
+// alignment, including names whose NUL is the last readable byte before an
+// unmapped page.
+static void check_hash() {
+  uint32_t x = 2463534242u;
+  auto next = [&x] {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+  };
+  auto same = [](const char* p, size_t want) {
+    size_t len = ~(size_t)0;
+    uint32_t h = overridehosts::hash_cstr(p, len);
+    if (len == want && h == overridehosts::hash_name(std::string_view(p, want))) return true;
+    fail("hash: length " + std::to_string(want) + " at offset " + std::to_string((uintptr_t)p & 4095) +
+         ": hash_cstr() disagrees with hash_name()");
+    return false;
+  };
+  auto fill = [&next](char* p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+      // Mostly name bytes in either case, sometimes anything but NUL.
+      unsigned r = next();
+      p[i] = (r & 7) ? "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-."[(r >> 3) % 64]
+                     : (char)(1 + (r >> 3) % 255);
+    }
+    p[len] = 0;
+  };
+
+  alignas(16) static char buf[16 + 300 + 1];
+  for (size_t len = 0; len <= 300; len++)
+    for (size_t align = 0; align < 16; align++) {
+      fill(buf + align, len);
+      if (!same(buf + align, len)) return;
+    }
+
+  long page = ::sysconf(_SC_PAGESIZE);
+  char* map = (char*)::mmap(nullptr, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED || ::mprotect(map + page, page, PROT_NONE) != 0) {
+    fail("hash: cannot map a guard page");
+    return;
+  }
+  for (size_t len = 0; len <= 100; len++) {
+    char* p = map + page - len - 1;
+    fill(p, len);
+    if (!same(p, len)) break;
+  }
+  ::munmap(map, 2 * page);
+}
+
+static int report() {
+  if (g_failures) {
+    std::cerr << "resolve_check: " << g_failures << " check(s) failed\n";
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (std::getenv(kChildEnv)) {
+    run_checks();
+    return report();
+  }
+  if (argc >= 2 && std::string(argv[1]) == "--probe") return probe(argc - 2, argv + 2);
+  if (argc == 3 && std::string(argv[1]) == "--reload") return reload(argv[2]);
+
+  std::string lib = "./liboverridehosts-glibc.so";
+  std::string wrapper, baked;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--lib" && i + 1 < argc) {
+      lib = argv[++i];
+    } else if (arg == "--wrapper" && i + 1 < argc) {
+      wrapper = argv[++i];
+    } else if (arg == "--baked" && i + 1 < argc) {
+      baked = argv[++i];
+    } else {
+      std::cerr << "usage: resolve_check [--lib <path>] [--wrapper <path>] [--baked <path>]\n";
+      return 2;
+    }
+  }
+  for (const std::string& f : {lib, wrapper, baked}) {
+    if (!f.empty() && ::access(f.c_str(), R_OK) != 0) {
+      std::cerr << "resolve_check: " << f << ": " << std::strerror(errno) << "\n";
+      return 2;
+    }
+  }
+  char self[PATH_MAX];
+  ssize_t n = ::readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (n <= 0) {
+    std::cerr << "resolve_check: cannot read /proc/self/exe\n";
+    return 2;
+  }
+  g_self.assign(self, (size_t)n);
+  for (const char* k : {"OVERRIDEHOSTS", "OVERRIDEHOSTS_FD", "OVERRIDEHOSTS_FILE", "OVERRIDEHOSTS_POLICY",
+                        "OVERRIDEHOSTS_SO", "OVERRIDEHOSTS_TRACE", "OVERRIDEHOSTS_STATS", "OVERRIDEHOSTS_CACHE_TTL",
+                        "OVERRIDEHOSTS_COALESCE", "OVERRIDEHOSTS_RELOAD", "LD_PRELOAD"})
+    ::unsetenv(k);
+
+  // ld.so resolves a bare name through the library path, not the cwd.
+  if (lib.find('/') == std::string::npos) lib = "./" + lib;
+  if (!baked.empty() && baked.find('/') == std::string::npos) baked = "./" + baked;
+  check_hash();
+  std::string stats = "/tmp/resolve_check." + std::to_string(::getpid()) + ".stats";
+  ::unlink(stats.c_str());
+  int rc = finish(start({g_self}, {{kChildEnv, "1"}, {"OVERRIDEHOSTS", kTable}, {"OVERRIDEHOSTS_TRACE", "1"},
+                                  {"OVERRIDEHOSTS_STATS", stats.c_str()}, {"OVERRIDEHOSTS_CACHE_TTL", "60"},
+                                  {"OVERRIDEHOSTS_COALESCE", "1"}, {"LD_PRELOAD", lib.c_str()}}));
+  if (rc != 0) g_failures++;
+  check_stats(stats);
+  ::unlink(stats.c_str());
+  check_spawn(lib);
+
+  std::string file = "/tmp/resolve_check." + std::to_string(::getpid()) + ".hosts";
+  std::ofstream(file) << "rl.test:10.9.9.1\n";
+  expect_run("reload", {g_self, "--reload", file},
+             {{"OVERRIDEHOSTS_FILE", file.c_str()}, {"OVERRIDEHOSTS_RELOAD", "1"}, {"LD_PRELOAD", lib.c_str()}});
+  ::unlink(file.c_str());
+  // A baked library answers from its own table whatever OVERRIDEHOSTS says.
+  if (!baked.empty())
+    expect_run("baked", {g_self, "--probe", "baked.test=10.9.10.1", "wild.baked.test=10.9.10.2"},
+               {{"OVERRIDEHOSTS", "baked.test:10.9.10.9"}, {"LD_PRELOAD", baked.c_str()}});
+  if (!wrapper.empty()) run_wrapper_checks(wrapper);
+  if (report()) return 1;
+  std::cout << "resolve_check: ok\n";
+  return 0;
+}
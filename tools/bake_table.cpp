@@ -0,0 +1,73 @@
+// bake_table.cpp
+//
+// Turns a mapping list into a C++ header holding the compiled table image
+// as a constexpr byte array, for a liboverridehosts built with the table
+// inside it (see the Makefile's `baked` target):
+//
+//   bake_table hosts.txt > baked-prod.h
+//   g++ ... -DOVERRIDEHOSTS_BAKED='"baked-prod.h"' liboverridehosts.cpp
+//
+// The input uses the wrapper's syntax (host:ip|ip*w, *.suffix, .suffix;
+// separated by commas or whitespace). Every item is validated and a bad
+// one is an error, not skipped. Exact names are spread over up to 64x as
+// many slots as names until none is displaced, so lookups in the baked
+// table probe once.
+//
+// Build:
+//   g++ -O2 -std=c++17 -o tools/bake_table tools/bake_table.cpp
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../overridehosts_parse.h"
+#include "../overridehosts_table.h"
+
+static void die(const std::string& msg) {
+  std::cerr << "bake_table: " << msg << "\n";
+  std::exit(1);
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " <mapping-list> > baked.h\n";
+    return 2;
+  }
+  std::ifstream in(argv[1]);
+  if (!in) die(std::string("cannot read ") + argv[1]);
+  std::ostringstream ss;
+  ss << in.rdbuf();
+  std::string text = ss.str();
+
+  overridehosts::TableBuilder b;
+  size_t names = 0;
+  size_t bad = overridehosts::for_each_mapping(text, [&](std::string_view item, const overridehosts::Mapping& m) {
+    if (!overridehosts::valid_host(m.host) || !overridehosts::valid_addr_list(m.addrs))
+      die("invalid mapping: " + std::string(item));
+    b.add(m.host, m.addrs);
+    names++;
+  });
+  if (bad) die("malformed item in mapping list (expected host:ip)");
+  if (!names) die(std::string("no mappings in ") + argv[1]);
+
+  uint64_t max_slots = std::max<uint64_t>(1024, (uint64_t)b.entries.size() * 64);
+  uint32_t displaced = b.spread_slots((uint32_t)std::min<uint64_t>(max_slots, 1u << 24));
+  std::vector<char> image = b.finish();
+  const overridehosts::ImageHeader* h = (const overridehosts::ImageHeader*)image.data();
+
+  std::printf("// Generated by tools/bake_table from %s; do not edit.\n", argv[1]);
+  std::printf("// %u entries, %u slots, %u exact names off their home slot.\n\n", h->entry_count, h->slot_count,
+              displaced);
+  std::printf("#pragma once\n\n#include <cstddef>\n\nnamespace overridehosts {\n\n");
+  std::printf("alignas(8) constexpr unsigned char kBakedImage[%zu] = {", image.size());
+  for (size_t i = 0; i < image.size(); i++)
+    std::printf("%s0x%02x,", i % 16 ? " " : "\n  ", (unsigned char)image[i]);
+  std::printf("\n};\n\n}  // namespace overridehosts\n");
+  return std::ferror(stdout) ? 1 : 0;
+}